@@ -107,7 +107,7 @@ class PngNQCompressor : Compressor {
 		let network = initnet(buffer, cols*rows*4, UInt32(colorCountBounded), gamma)
 		let map = UnsafeMutablePointer<UInt8>.allocate(capacity: Int(MAXNETSIZE)*4)
 		let remap = UnsafeMutablePointer<UInt32>.allocate(capacity: Int(MAXNETSIZE))
-		learn(network, UInt32(sampleFactor), 0)
+		learn(network, UInt32(sampleFactor), 1, 0)
 		inxbuild(network)
 		getcolormap(network, map)
 		
@@ -131,9 +131,14 @@ class PngNQCompressor : Compressor {
 		// Apply palette to image data (and dither).
 		let indexedData = UnsafeMutablePointer<UInt8>.allocate(capacity: w*h)
 		if shouldDither {
-			remap_floyd(network, buffer, cols, rows, map, remap, indexedData, 1)
+			if remap_floyd(network, buffer, cols, rows, map, remap, indexedData, 1) == 0 {
+				remap.deallocate()
+				map.deallocate()
+				indexedData.deallocate()
+				return nil
+			}
 		} else {
-			remap_simple(network, buffer, cols, rows, remap, indexedData)
+			remap_simple(network, buffer, cols, rows, remap, indexedData, UInt32(ProcessInfo.processInfo.activeProcessorCount))
 		}
 		
 		// Write PNG header.
@@ -173,17 +178,13 @@ class PngNQCompressor : Compressor {
 // Quantizer using mediantcut-posterizer.
 class PosterizerCompressor : Compressor {
 	
-	static var first = true
-	
 	static func compress(buffer: UnsafeMutablePointer<UInt8>, w: Int, h: Int, colorCount: Int, shouldDither: Bool) -> CompressedImage? {
-		// We only set gamma the first time (shared global array).
-		if first {
-			set_gamma(1.0)
-			first = false
-		}
-		// Posterization.
+		// Settings (gamma tables are local to each call).
 		let maxLevels = min(255, max(2, UInt32(colorCount)))
-		posterizer(buffer, UInt32(w), UInt32(h), maxLevels, shouldDither)
+		var context = posterizer_context()
+		posterizer_context_init(&context, 1.0, maxLevels, shouldDither)
+		// Posterization.
+		posterizer(&context, buffer, UInt32(w), UInt32(h))
 		// Write PNG data.
 		let output_file_data = UnsafeMutablePointer<UnsafeMutablePointer<UInt8>?>.allocate(capacity: 1)
 		var output_file_size : Int = 0
@@ -200,8 +201,9 @@ class BlurizerCompresser : Compressor {
 
 	static func compress(buffer: UnsafeMutablePointer<UInt8>, w: Int, h: Int, colorCount: Int, shouldDither: Bool) -> CompressedImage? {
 
-		let maxLevels = min(255, max(2, UInt32(colorCount)))
-		blurizer(buffer, UInt32(w), UInt32(h), maxLevels)
+		var context = posterizer_context()
+		posterizer_context_init(&context, 1.0, min(255, max(2, UInt32(colorCount))), false)
+		blurizer(&context, buffer, UInt32(w), UInt32(h))
 		
 		let output_file_data = UnsafeMutablePointer<UnsafeMutablePointer<UInt8>?>.allocate(capacity: 1)
 		var output_file_size : Int = 0
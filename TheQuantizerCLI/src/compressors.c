@@ -0,0 +1,160 @@
+//
+//  compressors.c
+//  TheQuantizerCLI
+//
+//  Mirrors TheQuantizer/Compressor.swift, keep both in sync.
+//
+
+#include "compressors.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libimagequant.h"
+#include "lodepng.h"
+#include "posterizer.h"
+#include "neuquant32.h"
+#include "pngnq.h"
+
+#define CLAMP_COLORS(c, lo, hi) ((c) < (lo) ? (lo) : ((c) > (hi) ? (hi) : (c)))
+
+/// Encode palettized pixels with the given RGBA palette.
+static bool encode_palettized(const unsigned char * pixels, unsigned int w, unsigned int h, const unsigned char * palette, unsigned int count, compressed_image * out)
+{
+	LodePNGState state;
+	lodepng_state_init(&state);
+	state.info_raw.colortype = LCT_PALETTE;
+	state.info_raw.bitdepth = 8;
+	state.info_png.color.colortype = LCT_PALETTE;
+	state.info_png.color.bitdepth = 8;
+	for(unsigned int i = 0; i < count; ++i){
+		const unsigned char * col = &palette[4*i];
+		lodepng_palette_add(&state.info_png.color, col[0], col[1], col[2], col[3]);
+		lodepng_palette_add(&state.info_raw, col[0], col[1], col[2], col[3]);
+	}
+	out->data = NULL;
+	out->size = 0;
+	const unsigned int status = lodepng_encode(&out->data, &out->size, pixels, w, h, &state);
+	lodepng_state_cleanup(&state);
+	if(status != 0){
+		free(out->data);
+		out->data = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool compress_pngquant(unsigned char * buffer, unsigned int w, unsigned int h, unsigned int color_count, bool should_dither, unsigned int threads, compressed_image * out)
+{
+	// Settings.
+	liq_attr * handle = liq_attr_create();
+	if(!handle){
+		return false;
+	}
+	liq_set_max_colors(handle, CLAMP_COLORS(color_count, 2, 256));
+
+	// Initial quantization.
+	liq_image * input_image = liq_image_create_rgba(handle, buffer, w, h, 0);
+	liq_result * quantization_result = NULL;
+	if(!input_image || liq_image_quantize(input_image, handle, &quantization_result) != LIQ_OK){
+		if(input_image){
+			liq_image_destroy(input_image);
+		}
+		liq_attr_destroy(handle);
+		return false;
+	}
+
+	// Apply quantization to image (with dithering).
+	const size_t pixels_size = (size_t)w * h;
+	unsigned char * raw_8bit_pixels = malloc(pixels_size);
+	liq_set_dithering_level(quantization_result, should_dither ? 1.0f : 0.0f);
+	bool ok = raw_8bit_pixels && liq_write_remapped_image(quantization_result, input_image, raw_8bit_pixels, pixels_size) == LIQ_OK;
+
+	if(ok){
+		// Get the palette and write PNG data.
+		const liq_palette * palette = liq_get_palette(quantization_result);
+		unsigned char palcol[4*256];
+		for(unsigned int i = 0; i < palette->count; ++i){
+			palcol[4*i+0] = palette->entries[i].r;
+			palcol[4*i+1] = palette->entries[i].g;
+			palcol[4*i+2] = palette->entries[i].b;
+			palcol[4*i+3] = palette->entries[i].a;
+		}
+		ok = encode_palettized(raw_8bit_pixels, w, h, palcol, palette->count, out);
+	}
+
+	// Bit of cleaning.
+	liq_result_destroy(quantization_result);
+	liq_image_destroy(input_image);
+	liq_attr_destroy(handle);
+	free(raw_8bit_pixels);
+	return ok;
+}
+
+bool compress_pngnq(unsigned char * buffer, unsigned int w, unsigned int h, unsigned int color_count, bool should_dither, unsigned int threads, compressed_image * out)
+{
+	// Settings.
+	const unsigned int color_count_bounded = CLAMP_COLORS(color_count, 2, 256);
+	const double gamma = 1.0;
+	unsigned int sample_factor = 1 + (unsigned int)((double)w * h / (512.0*512.0));
+	if(sample_factor > 10){
+		sample_factor = 10;
+	}
+
+	// Init network, learn color palette.
+	network_data * network = initnet(buffer, w*h*4, color_count_bounded, gamma);
+	if(!network){
+		return false;
+	}
+	unsigned char map[MAXNETSIZE*4];
+	unsigned int remap[MAXNETSIZE];
+	learn(network, sample_factor, threads, 0);
+	inxbuild(network);
+	getcolormap(network, map);
+
+	// The app keeps palette indices in network order (see PngNQCompressor).
+	for(unsigned int x = 0; x < color_count_bounded; ++x){
+		remap[x] = x;
+	}
+
+	// Apply palette to image data (and dither).
+	unsigned char * indexed_data = malloc((size_t)w * h);
+	if(!indexed_data){
+		free(network);
+		return false;
+	}
+	if(should_dither){
+		if(!remap_floyd(network, buffer, w, h, map, remap, indexed_data, 1)){
+			free(indexed_data);
+			free(network);
+			return false;
+		}
+	} else {
+		remap_simple(network, buffer, w, h, remap, indexed_data, threads);
+	}
+
+	// Write PNG data.
+	const bool ok = encode_palettized(indexed_data, w, h, map, color_count_bounded, out);
+
+	// Cleanup.
+	free(indexed_data);
+	free(network);
+	return ok;
+}
+
+bool compress_posterizer(unsigned char * buffer, unsigned int w, unsigned int h, unsigned int color_count, bool should_dither, unsigned int threads, compressed_image * out)
+{
+	// Posterization.
+	posterizer_context context;
+	posterizer_context_init(&context, 1.0, CLAMP_COLORS(color_count, 2, 255), should_dither);
+	posterizer(&context, buffer, w, h);
+	// Write PNG data.
+	out->data = NULL;
+	out->size = 0;
+	if(lodepng_encode32(&out->data, &out->size, buffer, w, h) != 0){
+		free(out->data);
+		out->data = NULL;
+		return false;
+	}
+	return true;
+}
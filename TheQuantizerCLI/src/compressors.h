@@ -0,0 +1,35 @@
+//
+//  compressors.h
+//  TheQuantizerCLI
+//
+//  Native counterparts of the compressors in TheQuantizer/Compressor.swift,
+//  so that the same decode/quantize/encode pipelines can run headless.
+//
+
+#ifndef COMPRESSORS_H
+#define COMPRESSORS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Just pack raw palettized-PNG data and its size.
+typedef struct {
+	unsigned char * data;
+	size_t size;
+} compressed_image;
+
+/// Compress a RGBA8 buffer of w*h pixels to PNG data. The buffer might be modified in place.
+/// threads is the number of threads a compressor can use for this single image.
+/// Returns true on success, in which case out->data has to be freed by the caller.
+typedef bool (*compressor_func)(unsigned char * buffer, unsigned int w, unsigned int h, unsigned int color_count, bool should_dither, unsigned int threads, compressed_image * out);
+
+/// Quantizer using libimagequant.
+bool compress_pngquant(unsigned char * buffer, unsigned int w, unsigned int h, unsigned int color_count, bool should_dither, unsigned int threads, compressed_image * out);
+
+/// Quantizer using PngNeuQuant.
+bool compress_pngnq(unsigned char * buffer, unsigned int w, unsigned int h, unsigned int color_count, bool should_dither, unsigned int threads, compressed_image * out);
+
+/// Quantizer using mediancut-posterizer.
+bool compress_posterizer(unsigned char * buffer, unsigned int w, unsigned int h, unsigned int color_count, bool should_dither, unsigned int threads, compressed_image * out);
+
+#endif
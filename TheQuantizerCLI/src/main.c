@@ -0,0 +1,370 @@
+//
+//  main.c
+//  TheQuantizerCLI
+//
+//  Batch quantization of PNG files, using the same pipelines as the app.
+//  Files are distributed over a pool of worker threads, one image per worker at a time.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "lodepng.h"
+#include "compressors.h"
+
+#define QUANTIZER_USAGE "\
+Usage: %s [-adfhv] [-m method] [-n colors] [-j threads] [-t threads] [-o dir] [-e ext] [input files]\n\
+Options:\n\
+-m Quantization method: pngquant (default), posterizer or pngnq.\n\
+-n Number of colors in the palette (levels per channel for posterizer). Range: 2 to 256. Defaults to 256.\n\
+-d Enable dithering.\n\
+-a Remove the alpha channel.\n\
+-j Number of worker threads. Defaults to the number of online processors.\n\
+-t Number of threads used within each image (pngnq learning and remapping). Defaults to 1.\n\
+-o Directory to put quantized images into. Defaults to the directory of each input file.\n\
+-e Suffix replacing the .png extension of output files. Defaults to -quant.png\n\
+-f Force overwriting of existing files.\n\
+-v Verbose mode, prints the result for each file.\n\
+-h Print this help.\n\
+input files: The png files to be processed. Paths are read from standard input (one per line) if not specified.\n"
+
+/// Settings shared by all workers.
+typedef struct {
+	compressor_func compressor;
+	unsigned int color_count;
+	unsigned int image_threads;
+	bool dither;
+	bool remove_alpha;
+	bool force;
+	bool verbose;
+	const char * output_dir;
+	const char * extension;
+} settings;
+
+/// One file to process.
+typedef struct {
+	char * path;
+	size_t input_size;
+	size_t output_size;
+	unsigned int w, h;
+	unsigned int error;
+	bool done;
+} job;
+
+typedef struct {
+	const settings * opts;
+	job * jobs;
+	size_t count;
+	atomic_size_t next;
+	pthread_mutex_t print_lock;
+} job_queue;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// Build the output path: output directory (or input directory) + input name without .png + extension.
+static char * output_path(const settings * opts, const char * input)
+{
+	const char * name = strrchr(input, '/');
+	name = name ? name + 1 : input;
+	size_t name_len = strlen(name);
+	if(name_len > 4 && strcasecmp(name + name_len - 4, ".png") == 0){
+		name_len -= 4;
+	}
+	const char * dir = opts->output_dir;
+	size_t dir_len;
+	if(dir){
+		dir_len = strlen(dir);
+	} else {
+		dir = input;
+		dir_len = name - input;
+	}
+	const size_t total = dir_len + 1 + name_len + strlen(opts->extension) + 1;
+	char * path = malloc(total);
+	if(!path){
+		return NULL;
+	}
+	if(opts->output_dir && dir_len > 0 && dir[dir_len-1] != '/'){
+		snprintf(path, total, "%.*s/%.*s%s", (int)dir_len, dir, (int)name_len, name, opts->extension);
+	} else {
+		snprintf(path, total, "%.*s%.*s%s", (int)dir_len, dir, (int)name_len, name, opts->extension);
+	}
+	return path;
+}
+
+enum {
+	ERR_NONE = 0,
+	ERR_DECODE,
+	ERR_EXISTS,
+	ERR_COMPRESS,
+	ERR_WRITE,
+	ERR_MEMORY,
+};
+
+static const char * error_string(unsigned int error)
+{
+	switch(error){
+		case ERR_DECODE: return "unable to decode PNG";
+		case ERR_EXISTS: return "output file exists (use -f)";
+		case ERR_COMPRESS: return "quantization failed";
+		case ERR_WRITE: return "unable to write output";
+		case ERR_MEMORY: return "out of memory";
+		default: return "ok";
+	}
+}
+
+static void process_job(const settings * opts, job * item)
+{
+	char * out_path = output_path(opts, item->path);
+	if(!out_path){
+		item->error = ERR_MEMORY;
+		return;
+	}
+	if(!opts->force && access(out_path, F_OK) == 0){
+		item->error = ERR_EXISTS;
+		free(out_path);
+		return;
+	}
+
+	// Load the file and decode it as RGBA8.
+	unsigned char * file_data = NULL;
+	size_t file_size = 0;
+	unsigned char * buffer = NULL;
+	if(lodepng_load_file(&file_data, &file_size, item->path) != 0 ||
+	   lodepng_decode32(&buffer, &item->w, &item->h, file_data, file_size) != 0){
+		free(file_data);
+		free(buffer);
+		free(out_path);
+		item->error = ERR_DECODE;
+		return;
+	}
+	free(file_data);
+	item->input_size = file_size;
+
+	// Remove alpha if needed.
+	if(opts->remove_alpha){
+		const size_t count = (size_t)item->w * item->h;
+		for(size_t i = 0; i < count; ++i){
+			buffer[4*i+3] = 255;
+		}
+	}
+
+	// The buffer is owned by this worker, so compressors can work in place.
+	compressed_image img;
+	if(!opts->compressor(buffer, item->w, item->h, opts->color_count, opts->dither, opts->image_threads, &img)){
+		item->error = ERR_COMPRESS;
+	} else {
+		if(lodepng_save_file(img.data, img.size, out_path) != 0){
+			item->error = ERR_WRITE;
+		}
+		item->output_size = img.size;
+		free(img.data);
+	}
+	free(buffer);
+	free(out_path);
+}
+
+static void * worker(void * arg)
+{
+	job_queue * queue = arg;
+	for(;;){
+		const size_t id = atomic_fetch_add(&queue->next, 1);
+		if(id >= queue->count){
+			break;
+		}
+		job * item = &queue->jobs[id];
+		process_job(queue->opts, item);
+		item->done = true;
+
+		if(queue->opts->verbose || item->error){
+			pthread_mutex_lock(&queue->print_lock);
+			if(item->error){
+				fprintf(stderr, "%s: %s\n", item->path, error_string(item->error));
+			} else {
+				const double pc = item->input_size ? 100.0 * ((double)item->input_size - item->output_size) / item->input_size : 0.0;
+				fprintf(stderr, "%s: %zu bytes (saved %.0f%% of %zu bytes)\n", item->path, item->output_size, pc, item->input_size);
+			}
+			pthread_mutex_unlock(&queue->print_lock);
+		}
+	}
+	return NULL;
+}
+
+/// Free the jobs and their paths.
+static void free_jobs(job * jobs, size_t count)
+{
+	for(size_t i = 0; i < count; ++i){
+		free(jobs[i].path);
+	}
+	free(jobs);
+}
+
+/// Read input paths from stdin, one per line. Returns NULL if out of memory.
+static job * read_stdin_jobs(size_t * count)
+{
+	size_t capacity = 64;
+	job * jobs = malloc(capacity * sizeof(job));
+	char * line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	*count = 0;
+	while(jobs && (len = getline(&line, &line_cap, stdin)) != -1){
+		while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')){
+			line[--len] = '\0';
+		}
+		if(len == 0){
+			continue;
+		}
+		if(*count == capacity){
+			capacity *= 2;
+			job * grown = realloc(jobs, capacity * sizeof(job));
+			if(!grown){
+				free_jobs(jobs, *count);
+				jobs = NULL;
+				break;
+			}
+			jobs = grown;
+		}
+		char * path = strdup(line);
+		if(!path){
+			free_jobs(jobs, *count);
+			jobs = NULL;
+			break;
+		}
+		jobs[(*count)++] = (job){ .path = path };
+	}
+	free(line);
+	return jobs;
+}
+
+int main(int argc, char * argv[])
+{
+	settings opts = {
+		.compressor = compress_pngquant,
+		.color_count = 256,
+		.image_threads = 1,
+		.extension = "-quant.png",
+	};
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int c;
+	while((c = getopt(argc, argv, "adfhvm:n:j:t:o:e:")) != -1){
+		switch(c){
+			case 'a': opts.remove_alpha = true; break;
+			case 'd': opts.dither = true; break;
+			case 'f': opts.force = true; break;
+			case 'v': opts.verbose = true; break;
+			case 'n': opts.color_count = (unsigned int)strtoul(optarg, NULL, 10); break;
+			case 'j': threads = strtol(optarg, NULL, 10); break;
+			case 't': opts.image_threads = (unsigned int)strtoul(optarg, NULL, 10); break;
+			case 'o': opts.output_dir = optarg; break;
+			case 'e': opts.extension = optarg; break;
+			case 'm':
+				if(strcmp(optarg, "pngquant") == 0){
+					opts.compressor = compress_pngquant;
+				} else if(strcmp(optarg, "posterizer") == 0){
+					opts.compressor = compress_posterizer;
+				} else if(strcmp(optarg, "pngnq") == 0){
+					opts.compressor = compress_pngnq;
+				} else {
+					fprintf(stderr, "Unknown method: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'h':
+				fprintf(stdout, QUANTIZER_USAGE, argv[0]);
+				return 0;
+			default:
+				fprintf(stderr, QUANTIZER_USAGE, argv[0]);
+				return 1;
+		}
+	}
+	if(opts.color_count < 2 || opts.color_count > 256){
+		fprintf(stderr, "Number of colors must be between 2 and 256.\n");
+		return 1;
+	}
+	if(threads < 1){
+		threads = 1;
+	}
+	if(opts.image_threads < 1){
+		opts.image_threads = 1;
+	}
+
+	// Gather the files to process.
+	job_queue queue = { .opts = &opts };
+	if(optind < argc){
+		queue.count = argc - optind;
+		queue.jobs = calloc(queue.count, sizeof(job));
+		for(size_t i = 0; queue.jobs && i < queue.count; ++i){
+			queue.jobs[i].path = strdup(argv[optind + i]);
+			if(!queue.jobs[i].path){
+				free_jobs(queue.jobs, i);
+				queue.jobs = NULL;
+			}
+		}
+	} else {
+		queue.jobs = read_stdin_jobs(&queue.count);
+	}
+	if(!queue.jobs){
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	if((size_t)threads > queue.count){
+		threads = queue.count > 0 ? (long)queue.count : 1;
+	}
+	atomic_init(&queue.next, 0);
+	pthread_mutex_init(&queue.print_lock, NULL);
+
+	// Run the pool.
+	const double start = now_seconds();
+	pthread_t * workers = malloc(threads * sizeof(pthread_t));
+	long started = 0;
+	for(; workers && started < threads; ++started){
+		if(pthread_create(&workers[started], NULL, worker, &queue) != 0){
+			break;
+		}
+	}
+	if(started == 0){
+		// Fall back to the main thread.
+		worker(&queue);
+	}
+	for(long i = 0; i < started; ++i){
+		pthread_join(workers[i], NULL);
+	}
+	const double elapsed = now_seconds() - start;
+
+	// Summary.
+	size_t succeeded = 0, failed = 0, total_in = 0, total_out = 0;
+	double megapixels = 0.0;
+	for(size_t i = 0; i < queue.count; ++i){
+		const job * item = &queue.jobs[i];
+		if(item->done && !item->error){
+			++succeeded;
+			total_in += item->input_size;
+			total_out += item->output_size;
+			megapixels += (double)item->w * item->h * 1e-6;
+		} else {
+			++failed;
+		}
+		free(item->path);
+	}
+	fprintf(stderr, "%zu files quantized, %zu failed, %zu -> %zu bytes in %.2fs (%.1f files/s, %.1f MP/s, %ld threads)\n",
+			succeeded, failed, total_in, total_out, elapsed,
+			elapsed > 0 ? succeeded / elapsed : 0.0, elapsed > 0 ? megapixels / elapsed : 0.0, started > 0 ? started : 1);
+
+	pthread_mutex_destroy(&queue.print_lock);
+	free(workers);
+	free(queue.jobs);
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,146 @@
+//
+//  neuquant_threads.c
+//  TheQuantizerCLI
+//
+//  Regression check: NeuQuant keeps all its state in network_data, so several images can be
+//  quantized at the same time on different threads without any lock. Every concurrent run
+//  has to give exactly the palette and indices of the same run done alone.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "neuquant32.h"
+#include "pngnq.h"
+
+#define INPUT_COUNT 4
+#define RUNS_PER_INPUT 3
+
+typedef struct {
+	unsigned int w, h, colors, sample_factor, double_precision;
+	double gamma;
+	unsigned char * pixels;
+} nq_input;
+
+typedef struct {
+	unsigned char map[MAXNETSIZE*4];
+	unsigned char * indices;
+} nq_output;
+
+typedef struct {
+	const nq_input * input;
+	nq_output output;
+	int ok;
+	pthread_t thread;
+} nq_run;
+
+static int quantize(const nq_input * input, nq_output * output)
+{
+	network_data * network = initnet(input->pixels, input->w*input->h*4, input->colors, input->gamma);
+	output->indices = malloc((size_t)input->w * input->h);
+	if(!network || !output->indices){
+		free(network);
+		return 0;
+	}
+	network->double_precision = input->double_precision;
+	unsigned int remap[MAXNETSIZE];
+	for(unsigned int x = 0; x < MAXNETSIZE; ++x){
+		remap[x] = x;
+	}
+	memset(output->map, 0, sizeof(output->map));
+	learn(network, input->sample_factor, 1, 0);
+	inxbuild(network);
+	getcolormap(network, output->map);
+	remap_simple(network, input->pixels, input->w, input->h, remap, output->indices, 1);
+	free(network);
+	return 1;
+}
+
+static void * quantize_thread(void * arg)
+{
+	nq_run * run = arg;
+	run->ok = quantize(run->input, &run->output);
+	return NULL;
+}
+
+int main(void)
+{
+	// Different sizes, palette sizes and settings, so that concurrent runs don't share anything but the code.
+	nq_input inputs[INPUT_COUNT] = {
+		{ 256, 192, 256, 1, 0, 1.0, NULL },
+		{ 300, 200, 64, 3, 0, 1.0/2.2, NULL },
+		{ 97, 131, 16, 1, 0, 1.0, NULL },
+		{ 200, 150, 128, 2, 1, 1.0, NULL },
+	};
+	unsigned int seed = 1;
+	for(int n = 0; n < INPUT_COUNT; ++n){
+		nq_input * input = &inputs[n];
+		input->pixels = malloc((size_t)input->w * input->h * 4);
+		if(!input->pixels){
+			return 1;
+		}
+		for(unsigned int i = 0; i < input->w*input->h; ++i){
+			const unsigned int x = i % input->w, y = i / input->w;
+			seed = seed * 1103515245u + 12345u;
+			unsigned char * px = &input->pixels[4*i];
+			px[0] = (unsigned char)(x * 255 / input->w + n * 40);
+			px[1] = (unsigned char)(y * 255 / input->h);
+			px[2] = (unsigned char)((seed >> 16) & (n == 2 ? 0xC0 : 0x3F));
+			px[3] = (n & 1) ? (unsigned char)(255 - (x + y) % 256) : 255;
+		}
+	}
+
+	// Reference runs, one at a time.
+	nq_output references[INPUT_COUNT];
+	for(int n = 0; n < INPUT_COUNT; ++n){
+		if(!quantize(&inputs[n], &references[n])){
+			fprintf(stderr, "Quantization of input %d failed.\n", n);
+			return 1;
+		}
+	}
+
+	// Every input several times, all at once.
+	nq_run runs[INPUT_COUNT*RUNS_PER_INPUT];
+	const int run_count = INPUT_COUNT*RUNS_PER_INPUT;
+	for(int r = 0; r < run_count; ++r){
+		runs[r].input = &inputs[r % INPUT_COUNT];
+		runs[r].output.indices = NULL;
+		runs[r].ok = 0;
+	}
+	int started = 0;
+	for(; started < run_count; ++started){
+		if(pthread_create(&runs[started].thread, NULL, quantize_thread, &runs[started]) != 0){
+			break;
+		}
+	}
+	for(int r = 0; r < started; ++r){
+		pthread_join(runs[r].thread, NULL);
+	}
+
+	int failures = 0;
+	if(started < run_count){
+		fprintf(stderr, "Only %d threads could be started.\n", started);
+		++failures;
+	}
+	for(int r = 0; r < started; ++r){
+		const int n = r % INPUT_COUNT;
+		const nq_input * input = &inputs[n];
+		if(!runs[r].ok
+		   || memcmp(runs[r].output.map, references[n].map, sizeof(references[n].map)) != 0
+		   || memcmp(runs[r].output.indices, references[n].indices, (size_t)input->w * input->h) != 0){
+			fprintf(stderr, "Concurrent run %d of input %d differs from the serial run.\n", r / INPUT_COUNT, n);
+			++failures;
+		}
+		free(runs[r].output.indices);
+	}
+	for(int n = 0; n < INPUT_COUNT; ++n){
+		free(references[n].indices);
+		free(inputs[n].pixels);
+	}
+	if(failures == 0){
+		printf("Concurrent NeuQuant runs match the serial ones.\n");
+	}
+	return failures ? 1 : 0;
+}
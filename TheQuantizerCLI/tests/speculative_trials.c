@@ -0,0 +1,92 @@
+//
+//  speculative_trials.c
+//  TheQuantizerCLI
+//
+//  Regression check: with several speculative trials, libimagequant has to pick the same palette
+//  whatever the number of OpenMP threads.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libimagequant.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_set_num_threads(n)
+#endif
+
+#define WIDTH 400
+#define HEIGHT 400
+
+static int quantize(const unsigned char * pixels, int trials, int threads, liq_palette * palette)
+{
+	omp_set_num_threads(threads);
+	liq_attr * attr = liq_attr_create();
+	liq_set_speed(attr, 1);
+	liq_set_max_colors(attr, 64);
+	liq_set_speculative_trials(attr, trials);
+	liq_image * image = liq_image_create_rgba(attr, pixels, WIDTH, HEIGHT, 0);
+	liq_result * result = NULL;
+	if(!image || liq_image_quantize(image, attr, &result) != LIQ_OK){
+		liq_image_destroy(image);
+		liq_attr_destroy(attr);
+		return 0;
+	}
+	*palette = *liq_get_palette(result);
+	liq_result_destroy(result);
+	liq_image_destroy(image);
+	liq_attr_destroy(attr);
+	return 1;
+}
+
+int main(void)
+{
+	// Noisy gradient, with enough distinct colors for the palette search to take several rounds.
+	unsigned char * pixels = malloc(WIDTH*HEIGHT*4);
+	if(!pixels){
+		return 1;
+	}
+	unsigned int seed = 1;
+	for(unsigned int i = 0; i < WIDTH*HEIGHT; ++i){
+		const unsigned int x = i % WIDTH, y = i / WIDTH;
+		for(int c = 0; c < 3; ++c){
+			seed = seed * 1103515245u + 12345u;
+			const int value = (c == 0 ? x : (c == 1 ? y : x + y)) * 255 / (c == 2 ? WIDTH + HEIGHT : WIDTH) + (int)((seed >> 16) % 33) - 16;
+			pixels[4*i+c] = value < 0 ? 0 : (value > 255 ? 255 : value);
+		}
+		pixels[4*i+3] = 255;
+	}
+
+	const int trials[] = { 1, 4 };
+	const int threads[] = { 1, 2, 3, 4 };
+	int failures = 0;
+	for(size_t t = 0; t < sizeof(trials)/sizeof(trials[0]); ++t){
+		liq_palette reference;
+		if(!quantize(pixels, trials[t], threads[0], &reference)){
+			fprintf(stderr, "Quantization failed with %d trials.\n", trials[t]);
+			++failures;
+			continue;
+		}
+		for(size_t n = 1; n < sizeof(threads)/sizeof(threads[0]); ++n){
+			// Run each case a few times, a race doesn't show up on every run.
+			for(int run = 0; run < 3; ++run){
+				liq_palette palette;
+				if(!quantize(pixels, trials[t], threads[n], &palette)
+				   || palette.count != reference.count
+				   || memcmp(palette.entries, reference.entries, sizeof(palette.entries[0]) * palette.count) != 0){
+					fprintf(stderr, "%d trials on %d threads give another palette than on %d thread.\n", trials[t], threads[n], threads[0]);
+					++failures;
+					break;
+				}
+			}
+		}
+	}
+	free(pixels);
+	if(failures == 0){
+		printf("Speculative trials don't depend on the number of threads.\n");
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+//
+//  tiny_images.c
+//  TheQuantizerCLI
+//
+//  Regression check: every compressor has to finish on images of only a few pixels.
+//  A hang is caught by an alarm.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compressors.h"
+
+typedef struct {
+	const char * name;
+	compressor_func compressor;
+} named_compressor;
+
+int main(void)
+{
+	const named_compressor compressors[] = {
+		{ "pngquant", compress_pngquant },
+		{ "pngnq", compress_pngnq },
+		{ "posterizer", compress_posterizer },
+	};
+	const unsigned int sizes[][2] = { {1, 1}, {1, 3}, {3, 1}, {2, 2} };
+	const unsigned char colors[4][4] = { {255, 0, 0, 255}, {0, 128, 255, 255}, {10, 20, 30, 0}, {200, 200, 200, 128} };
+
+	// Each image takes milliseconds, so this is generous.
+	alarm(60);
+
+	int failures = 0;
+	for(size_t c = 0; c < sizeof(compressors)/sizeof(compressors[0]); ++c){
+		for(size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s){
+			for(int dither = 0; dither < 2; ++dither){
+				const unsigned int w = sizes[s][0], h = sizes[s][1];
+				unsigned char buffer[4*4];
+				for(unsigned int i = 0; i < w*h; ++i){
+					memcpy(&buffer[4*i], colors[i], 4);
+				}
+				compressed_image out;
+				if(!compressors[c].compressor(buffer, w, h, 256, dither, 1, &out)){
+					fprintf(stderr, "%s failed on a %ux%u image (dithering %s).\n", compressors[c].name, w, h, dither ? "on" : "off");
+					++failures;
+					continue;
+				}
+				free(out.data);
+			}
+		}
+	}
+	if(failures == 0){
+		printf("All tiny images quantized.\n");
+	}
+	return failures ? 1 : 0;
+}
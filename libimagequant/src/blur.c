@@ -22,43 +22,86 @@ along with libimagequant. If not, see <http://www.gnu.org/licenses/>.
 #include "blur.h"
 
 /*
- Blurs image horizontally (width 2*size+1) and writes it transposed to dst (called twice gives 2d blur)
+ Averages 2*size pixels from i-size+1 to i+size (edge pixels are repeated outside the row) for pixels start..end-1 of a row
  */
-static void transposing_1d_blur(unsigned char *restrict src, unsigned char *restrict dst, unsigned int width, unsigned int height, const unsigned int size)
+static void blur_row(const unsigned char *restrict row, unsigned char *restrict dst_row, const int width, const int size, const int start, const int end)
 {
-    assert(size > 0);
+    unsigned int sum = 0;
+    for(int k=start-size; k < start+size; k++) {
+        sum += row[MAX(0, MIN(width-1, k))];
+    }
+    for(int i=start; i < end; i++) {
+        sum -= row[MAX(0, MIN(width-1, i-size))];
+        sum += row[MAX(0, MIN(width-1, i+size))];
+        dst_row[i] = sum / (size*2);
+    }
+}
 
+static void horizontal_blur(const unsigned char *restrict src, unsigned char *restrict dst, const unsigned int width, const unsigned int height, const unsigned int size)
+{
+    #pragma omp parallel for if (width*height > 50000) \
+        schedule(static) default(shared)
     for(unsigned int j=0; j < height; j++) {
-        unsigned char *restrict row = src + j*width;
-
-        // accumulate sum for pixels outside line
-        unsigned int sum;
-        sum = row[0]*size;
-        for(unsigned int i=0; i < size; i++) {
-            sum += row[i];
+        const unsigned char *restrict row = src + j*width;
+        unsigned char *restrict dst_row = dst + j*width;
+
+        unsigned int i=0;
+#if USE_SSE
+        // 16 pixels at a time where all 2*size of them are inside the row. Rounded up reciprocal gives exact division for size <= 8.
+        if (size <= 8) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i reciprocal = _mm_set1_epi16((65536 + size*2 - 1) / (size*2));
+            blur_row(row, dst_row, width, size, 0, size-1);
+            for(i=size-1; i + 16 + size <= width; i += 16) {
+                __m128i sum_lo = zero, sum_hi = zero;
+                for(unsigned int k=i+1-size; k <= i+size; k++) {
+                    const __m128i px = _mm_loadu_si128((const __m128i*)&row[k]);
+                    sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(px, zero));
+                    sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(px, zero));
+                }
+                _mm_storeu_si128((__m128i*)&dst_row[i], _mm_packus_epi16(_mm_mulhi_epu16(sum_lo, reciprocal), _mm_mulhi_epu16(sum_hi, reciprocal)));
+            }
         }
+#endif
+        blur_row(row, dst_row, width, size, i, width);
+    }
+}
 
-        // blur with left side outside line
-        for(unsigned int i=0; i < size; i++) {
-            sum -= row[0];
-            sum += row[i+size];
-
-            dst[i*height + j] = sum / (size*2);
-        }
-
-        for(unsigned int i=size; i < width-size; i++) {
-            sum -= row[i-size];
-            sum += row[i+size];
-
-            dst[i*height + j] = sum / (size*2);
+/*
+ Same as horizontal_blur, but averages rows from j-size+1 to j+size
+ */
+static void vertical_blur(const unsigned char *restrict src, unsigned char *restrict dst, const unsigned int width, const unsigned int height, const unsigned int size)
+{
+    #pragma omp parallel for if (width*height > 50000) \
+        schedule(static) default(shared)
+    for(unsigned int j=0; j < height; j++) {
+        // rows j-size+1 to j+size, edge rows are repeated outside the image
+        const int first_row = (int)j+1-(int)size;
+        unsigned char *restrict dst_row = dst + j*width;
+
+        unsigned int i=0;
+#if USE_SSE
+        if (size <= 8) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i reciprocal = _mm_set1_epi16((65536 + size*2 - 1) / (size*2));
+            for(; i + 16 <= width; i += 16) {
+                __m128i sum_lo = zero, sum_hi = zero;
+                for(unsigned int k=0; k < 2*size; k++) {
+                    const int y = MAX(0, MIN((int)height-1, first_row+(int)k));
+                    const __m128i px = _mm_loadu_si128((const __m128i*)&src[y*width + i]);
+                    sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(px, zero));
+                    sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(px, zero));
+                }
+                _mm_storeu_si128((__m128i*)&dst_row[i], _mm_packus_epi16(_mm_mulhi_epu16(sum_lo, reciprocal), _mm_mulhi_epu16(sum_hi, reciprocal)));
+            }
         }
-
-        // blur with right side outside line
-        for(unsigned int i=width-size; i < width; i++) {
-            sum -= row[i-size];
-            sum += row[width-1];
-
-            dst[i*height + j] = sum / (size*2);
+#endif
+        for(; i < width; i++) {
+            unsigned int sum = 0;
+            for(unsigned int k=0; k < 2*size; k++) {
+                sum += src[MAX(0, MIN((int)height-1, first_row+(int)k))*width + i];
+            }
+            dst_row[i] = sum / (size*2);
         }
     }
 }
@@ -68,25 +111,33 @@ static void transposing_1d_blur(unsigned char *restrict src, unsigned char *rest
  */
 LIQ_PRIVATE void liq_max3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height)
 {
+    #pragma omp parallel for if (width*height > 50000) \
+        schedule(static) default(shared)
     for(unsigned int j=0; j < height; j++) {
         const unsigned char *row = src + j*width,
         *prevrow = src + (j > 1 ? j-1 : 0)*width,
         *nextrow = src + MIN(height-1,j+1)*width;
-
-        unsigned char prev,curr=row[0],next=row[0];
-
-        for(unsigned int i=0; i < width-1; i++) {
-            prev=curr;
-            curr=next;
-            next=row[i+1];
-
-            unsigned char t1 = MAX(prev,next);
+        unsigned char *dst_row = dst + j*width;
+
+        unsigned int i=1;
+#if USE_SSE
+        for(; i + 17 <= width; i += 16) {
+            const __m128i t1 = _mm_max_epu8(_mm_loadu_si128((const __m128i*)&row[i-1]), _mm_loadu_si128((const __m128i*)&row[i+1]));
+            const __m128i t2 = _mm_max_epu8(_mm_loadu_si128((const __m128i*)&nextrow[i]), _mm_loadu_si128((const __m128i*)&prevrow[i]));
+            _mm_storeu_si128((__m128i*)&dst_row[i], _mm_max_epu8(_mm_loadu_si128((const __m128i*)&row[i]), _mm_max_epu8(t1, t2)));
+        }
+#endif
+        for(; i < width-1; i++) {
+            unsigned char t1 = MAX(row[i-1],row[i+1]);
             unsigned char t2 = MAX(nextrow[i],prevrow[i]);
-            *dst++ = MAX(curr,MAX(t1,t2));
+            dst_row[i] = MAX(row[i],MAX(t1,t2));
+        }
+
+        // edge pixels are repeated outside the row
+        dst_row[0] = MAX(MAX(row[0],row[MIN(width-1,1)]), MAX(nextrow[0],prevrow[0]));
+        if (width > 1) {
+            dst_row[width-1] = MAX(MAX(row[width-2],row[width-1]), MAX(nextrow[width-1],prevrow[width-1]));
         }
-        unsigned char t1 = MAX(curr,next);
-        unsigned char t2 = MAX(nextrow[width-1],prevrow[width-1]);
-        *dst++ = MAX(t1,t2);
     }
 }
 
@@ -95,25 +146,33 @@ LIQ_PRIVATE void liq_max3(unsigned char *src, unsigned char *dst, unsigned int w
  */
 LIQ_PRIVATE void liq_min3(unsigned char *src, unsigned char *dst, unsigned int width, unsigned int height)
 {
+    #pragma omp parallel for if (width*height > 50000) \
+        schedule(static) default(shared)
     for(unsigned int j=0; j < height; j++) {
         const unsigned char *row = src + j*width,
         *prevrow = src + (j > 1 ? j-1 : 0)*width,
         *nextrow = src + MIN(height-1,j+1)*width;
-
-        unsigned char prev,curr=row[0],next=row[0];
-
-        for(unsigned int i=0; i < width-1; i++) {
-            prev=curr;
-            curr=next;
-            next=row[i+1];
-
-            unsigned char t1 = MIN(prev,next);
+        unsigned char *dst_row = dst + j*width;
+
+        unsigned int i=1;
+#if USE_SSE
+        for(; i + 17 <= width; i += 16) {
+            const __m128i t1 = _mm_min_epu8(_mm_loadu_si128((const __m128i*)&row[i-1]), _mm_loadu_si128((const __m128i*)&row[i+1]));
+            const __m128i t2 = _mm_min_epu8(_mm_loadu_si128((const __m128i*)&nextrow[i]), _mm_loadu_si128((const __m128i*)&prevrow[i]));
+            _mm_storeu_si128((__m128i*)&dst_row[i], _mm_min_epu8(_mm_loadu_si128((const __m128i*)&row[i]), _mm_min_epu8(t1, t2)));
+        }
+#endif
+        for(; i < width-1; i++) {
+            unsigned char t1 = MIN(row[i-1],row[i+1]);
             unsigned char t2 = MIN(nextrow[i],prevrow[i]);
-            *dst++ = MIN(curr,MIN(t1,t2));
+            dst_row[i] = MIN(row[i],MIN(t1,t2));
+        }
+
+        // edge pixels are repeated outside the row
+        dst_row[0] = MIN(MIN(row[0],row[MIN(width-1,1)]), MIN(nextrow[0],prevrow[0]));
+        if (width > 1) {
+            dst_row[width-1] = MIN(MIN(row[width-2],row[width-1]), MIN(nextrow[width-1],prevrow[width-1]));
         }
-        unsigned char t1 = MIN(curr,next);
-        unsigned char t2 = MIN(nextrow[width-1],prevrow[width-1]);
-        *dst++ = MIN(t1,t2);
     }
 }
 
@@ -127,6 +186,6 @@ LIQ_PRIVATE void liq_blur(unsigned char *src, unsigned char *tmp, unsigned char
     if (width < 2*size+1 || height < 2*size+1) {
         return;
     }
-    transposing_1d_blur(src, tmp, width, height, size);
-    transposing_1d_blur(tmp, dst, height, width, size);
+    horizontal_blur(src, tmp, width, height, size);
+    vertical_blur(tmp, dst, width, height, size);
 }
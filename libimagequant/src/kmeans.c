@@ -68,13 +68,13 @@ LIQ_PRIVATE double kmeans_do_iteration(histogram *hist, colormap *const map, kme
     const unsigned int max_threads = omp_get_max_threads();
     LIQ_ARRAY(kmeans_state, average_color, (KMEANS_CACHE_LINE_GAP+map->colors) * max_threads);
     kmeans_init(map, max_threads, average_color);
-    struct nearest_map *const n = nearest_init(map);
+    struct nearest_map *const n = nearest_init(map, -1);
     hist_item *const achv = hist->achv;
     const int hist_size = hist->size;
 
     double total_diff=0;
     #pragma omp parallel for if (hist_size > 2000) \
-        schedule(static) default(none) shared(average_color,callback) reduction(+:total_diff)
+        schedule(static) default(shared) reduction(+:total_diff)
     for(int j=0; j < hist_size; j++) {
         float diff;
         unsigned int match = nearest_search(n, &achv[j].acolor, achv[j].tmp.likely_colormap_index, &diff);
@@ -91,3 +91,157 @@ LIQ_PRIVATE double kmeans_do_iteration(histogram *hist, colormap *const map, kme
 
     return total_diff / hist->total_perceptual_weight;
 }
+
+typedef struct {
+    float diff; // colordifference between palette colors
+    unsigned int idx;
+} kmeans_neighbor;
+
+static int kmeans_compare_neighbors(const void *ap, const void *bp)
+{
+    const float a = ((const kmeans_neighbor*)ap)->diff, b = ((const kmeans_neighbor*)bp)->diff;
+    return a > b ? 1 : (a < b ? -1 : 0);
+}
+
+/*
+ * For every palette color, lists other colors from the nearest one
+ */
+static void kmeans_sort_neighbors(const colormap *map, kmeans_neighbor neighbors[])
+{
+    const unsigned int colors = map->colors;
+    for(unsigned int i=0; i < colors; i++) {
+        kmeans_neighbor *const row = &neighbors[i*colors];
+        unsigned int num = 0;
+        for(unsigned int j=0; j < colors; j++) {
+            if (j != i) {
+                row[num++] = (kmeans_neighbor){
+                    .diff = colordifference(map->palette[i].acolor, map->palette[j].acolor),
+                    .idx = j,
+                };
+            }
+        }
+        qsort(row, num, sizeof(row[0]), kmeans_compare_neighbors);
+        row[num] = (kmeans_neighbor){.diff = MAX_DIFF}; // sentinel
+    }
+}
+
+/*
+ * Colors farther than twice the distance from the guessed color can't be closer than it (triangle inequality),
+ * so usually only a few nearest colors of the guess have to be checked to be sure it's still the nearest.
+ * Returns false if some color is closer.
+ */
+inline static bool kmeans_guess_is_nearest(const colormap *map, const kmeans_neighbor row[], const f_pixel px, const float guess_diff)
+{
+    // small margin, because rounding must not skip a color that's closer
+    const float limit = guess_diff * (4.f * 1.001f);
+    for(unsigned int i=0; row[i].diff < limit; i++) {
+        if (colordifference(map->palette[row[i].idx].acolor, px) < guess_diff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Runs up to max_iterations of K-Means on the histogram, until the palette stops improving by more than iteration_limit.
+ * Threads are started once for all iterations. The callback gets MSE after every iteration (counted from 0), and can stop the refinement by returning false.
+ *
+ * Between iterations colors move only a little, so most histogram entries keep their nearest color,
+ * and that is checked against the nearest colors of the guess instead of searching the whole palette.
+ */
+LIQ_PRIVATE double kmeans_refine(histogram *hist, colormap *const map, const unsigned int max_iterations, const double iteration_limit, const double max_mse, kmeans_iteration_callback callback, void *user_info)
+{
+    const unsigned int max_threads = omp_get_max_threads();
+    LIQ_ARRAY(kmeans_state, average_color, (KMEANS_CACHE_LINE_GAP+map->colors) * max_threads);
+    LIQ_ARRAY(double, thread_diff, max_threads);
+    hist_item *const achv = hist->achv;
+    const int hist_size = hist->size;
+    const unsigned int colors = map->colors;
+    float nearest_other_diff[256];
+
+    // it's only an optimization, so it's skipped if there's no memory for it, or the histogram is too small to pay for sorting
+    kmeans_neighbor *const neighbors = hist_size > colors*colors ? map->malloc(sizeof(neighbors[0]) * colors * colors) : NULL;
+
+    struct nearest_map *n = NULL;
+    double palette_error = -1, previous_palette_error = MAX_DIFF;
+    unsigned int iteration = 0;
+    bool done = !max_iterations;
+
+    #pragma omp parallel if (hist_size > 1000) \
+        default(shared)
+    while(!done) {
+        #pragma omp single
+        {
+            kmeans_init(map, max_threads, average_color);
+            memset(thread_diff, 0, sizeof(thread_diff[0])*max_threads);
+            n = nearest_init(map, -1);
+            if (neighbors) {
+                kmeans_sort_neighbors(map, neighbors);
+                for(unsigned int i=0; i < colors; i++) {
+                    nearest_other_diff[i] = nearest_other_color_diff(n, i) / 4.f;
+                }
+            }
+        }
+
+        const unsigned int thread = omp_get_thread_num();
+        double diff_sum = 0;
+        #pragma omp for schedule(static)
+        for(int j=0; j < hist_size; j++) {
+            const unsigned int guess = achv[j].tmp.likely_colormap_index;
+            float diff;
+            unsigned int match;
+            if (!neighbors) {
+                match = nearest_search(n, &achv[j].acolor, guess, &diff);
+            } else {
+                diff = colordifference(map->palette[guess].acolor, achv[j].acolor);
+                if (diff < nearest_other_diff[guess]) {
+                    match = guess; // same shortcut nearest_search takes
+                } else if (kmeans_guess_is_nearest(map, &neighbors[guess*colors], achv[j].acolor, diff)) {
+                    match = guess;
+                    const float distance = sqrtf(diff);
+                    diff = distance * distance; // nearest_search gives distance squared
+                } else {
+                    match = nearest_search(n, &achv[j].acolor, guess, &diff);
+                }
+            }
+            achv[j].tmp.likely_colormap_index = match;
+            diff_sum += diff * achv[j].perceptual_weight;
+
+            kmeans_update_color(achv[j].acolor, achv[j].perceptual_weight, map, match, thread, average_color);
+        }
+        thread_diff[thread] = diff_sum;
+        #pragma omp barrier
+
+        // the callback reports progress to the user, so it runs on the thread that called this
+        #pragma omp master
+        {
+            nearest_free(n);
+            kmeans_finalize(map, max_threads, average_color);
+
+            double total_diff = 0;
+            for(unsigned int t=0; t < max_threads; t++) {
+                total_diff += thread_diff[t];
+            }
+            palette_error = total_diff / hist->total_perceptual_weight;
+
+            if (callback && !callback(iteration, max_iterations, palette_error, user_info)) {
+                done = true;
+            }
+            else if (fabs(previous_palette_error-palette_error) < iteration_limit) {
+                done = true;
+            }
+            else if (palette_error > max_mse*1.5) { // probably hopeless
+                if (palette_error > max_mse*3.0) done = true; // definitely hopeless
+                iteration++;
+            }
+            previous_palette_error = palette_error;
+            if (++iteration >= max_iterations) done = true;
+        }
+        #pragma omp barrier
+    }
+
+    if (neighbors) {
+        map->free(neighbors);
+    }
+    return palette_error;
+}
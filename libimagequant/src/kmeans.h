@@ -10,10 +10,12 @@ typedef struct {
 } kmeans_state;
 
 typedef void (*kmeans_callback)(hist_item *item, float diff);
+typedef bool (*kmeans_iteration_callback)(unsigned int iteration, unsigned int max_iterations, double mse, void *user_info);
 
 LIQ_PRIVATE void kmeans_init(const colormap *map, const unsigned int max_threads, kmeans_state state[]);
 LIQ_PRIVATE void kmeans_update_color(const f_pixel acolor, const float value, const colormap *map, unsigned int match, const unsigned int thread, kmeans_state average_color[]);
 LIQ_PRIVATE void kmeans_finalize(colormap *map, const unsigned int max_threads, const kmeans_state state[]);
 LIQ_PRIVATE double kmeans_do_iteration(histogram *hist, colormap *const map, kmeans_callback callback);
+LIQ_PRIVATE double kmeans_refine(histogram *hist, colormap *const map, const unsigned int max_iterations, const double iteration_limit, const double max_mse, kmeans_iteration_callback callback, void *user_info);
 
 #endif
@@ -26,6 +26,7 @@
 #define LIQ_TEMP_ROW_WIDTH(img_width) (img_width)
 #define omp_get_max_threads() 1
 #define omp_get_thread_num() 0
+#define omp_get_num_threads() 1
 #endif
 
 #include "libimagequant.h"
@@ -55,12 +56,12 @@ struct liq_attr {
 
     double target_mse, max_mse, kmeans_iteration_limit;
     float min_opaque_val;
-    unsigned int max_colors, max_histogram_entries;
+    unsigned int max_colors, max_histogram_entries, max_histogram_samples;
     unsigned int min_posterization_output /* user setting */, min_posterization_input /* speed setting */;
     unsigned int kmeans_iterations, feedback_loop_trials;
     bool last_index_transparent, use_contrast_maps;
     unsigned char use_dither_map;
-    unsigned char speed;
+    unsigned char speed, speculative_trials;
 
     unsigned char progress_stage1, progress_stage2, progress_stage3;
     liq_progress_callback_function *progress_callback;
@@ -106,6 +107,7 @@ typedef struct liq_remapping_result {
     liq_palette int_palette;
     double gamma, palette_error;
     float dither_level;
+    liq_dithering_mode dither_mode;
     unsigned char use_dither_map;
     unsigned char progress_stage1;
 } liq_remapping_result;
@@ -117,11 +119,13 @@ struct liq_result {
 
     liq_remapping_result *remapping;
     colormap *palette;
+    struct color_index_map *index_map;
     liq_progress_callback_function *progress_callback;
     void *progress_callback_user_info;
 
     liq_palette int_palette;
     float dither_level;
+    liq_dithering_mode dither_mode;
     double gamma, palette_error;
     int min_posterization_output;
     unsigned char use_dither_map;
@@ -344,6 +348,7 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_set_speed(liq_attr* attr, int speed)
     attr->feedback_loop_trials = MAX(56-9*speed, 0);
 
     attr->max_histogram_entries = (1<<17) + (1<<18)*(10-speed);
+    attr->max_histogram_samples = (speed >= 4) ? (1<<21)*(11-speed) : ~0u; // larger images are subsampled
     attr->min_posterization_input = (speed >= 8) ? 1 : 0;
     attr->use_dither_map = (speed <= (omp_get_max_threads() > 1 ? 7 : 5)); // parallelized dither map might speed up floyd remapping
     if (attr->use_dither_map && speed < 3) {
@@ -368,6 +373,22 @@ LIQ_EXPORT LIQ_NONNULL int liq_get_speed(const liq_attr *attr)
     return attr->speed;
 }
 
+LIQ_EXPORT LIQ_NONNULL liq_error liq_set_speculative_trials(liq_attr* attr, int trials)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return LIQ_INVALID_POINTER;
+    if (trials < 1 || trials > 16) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->speculative_trials = trials;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT LIQ_NONNULL int liq_get_speculative_trials(const liq_attr *attr)
+{
+    if (!CHECK_STRUCT_TYPE(attr, liq_attr)) return -1;
+
+    return attr->speculative_trials;
+}
+
 LIQ_EXPORT LIQ_NONNULL liq_error liq_set_output_gamma(liq_result* res, double gamma)
 {
     if (!CHECK_STRUCT_TYPE(res, liq_result)) return LIQ_INVALID_POINTER;
@@ -514,6 +535,7 @@ LIQ_EXPORT liq_attr* liq_attr_create_with_allocator(void* (*custom_malloc)(size_
         .last_index_transparent = false, // puts transparent color at last index. This is workaround for blu-ray subtitles.
         .target_mse = 0,
         .max_mse = MAX_DIFF,
+        .speculative_trials = 1,
     };
     liq_set_speed(attr, 4);
     return attr;
@@ -802,6 +824,66 @@ LIQ_NONNULL static const rgba_pixel *liq_image_get_row_rgba(liq_image *img, unsi
     return temp_row;
 }
 
+#if USE_SSE
+/*
+ Same as rgba_to_f for 4 pixels at a time: one division for all alphas, gamma lookups
+ gathered per channel, then transposed back to f_pixel. Returns number of pixels done.
+ */
+LIQ_NONNULL static unsigned int convert_row_to_f_sse(f_pixel *restrict row_f_pixels, const rgba_pixel *restrict row_pixels, const unsigned int width, const float gamma_lut[])
+{
+    const __m128 max_alpha = _mm_set1_ps(255.f);
+    unsigned int col=0;
+    for(; col + 4 <= width; col += 4) {
+        const rgba_pixel *const px = &row_pixels[col];
+        const __m128i packed = _mm_loadu_si128((const __m128i *)px);
+        __m128 a = _mm_div_ps(_mm_cvtepi32_ps(_mm_srli_epi32(packed, 24)), max_alpha);
+        __m128 r = _mm_mul_ps(_mm_setr_ps(gamma_lut[px[0].r], gamma_lut[px[1].r], gamma_lut[px[2].r], gamma_lut[px[3].r]), a);
+        __m128 g = _mm_mul_ps(_mm_setr_ps(gamma_lut[px[0].g], gamma_lut[px[1].g], gamma_lut[px[2].g], gamma_lut[px[3].g]), a);
+        __m128 b = _mm_mul_ps(_mm_setr_ps(gamma_lut[px[0].b], gamma_lut[px[1].b], gamma_lut[px[2].b], gamma_lut[px[3].b]), a);
+        _MM_TRANSPOSE4_PS(a, r, g, b);
+        float *const out = (float *)&row_f_pixels[col];
+        _mm_store_ps(out, a);
+        _mm_store_ps(out + 4, r);
+        _mm_store_ps(out + 8, g);
+        _mm_store_ps(out + 12, b);
+    }
+    return col;
+}
+#endif
+
+#if USE_AVX2
+/* As above with 8 pixels at a time */
+LIQ_NONNULL static unsigned int convert_row_to_f_avx2(f_pixel *restrict row_f_pixels, const rgba_pixel *restrict row_pixels, const unsigned int width, const float gamma_lut[])
+{
+    const __m256 max_alpha = _mm256_set1_ps(255.f);
+    unsigned int col=0;
+    for(; col + 8 <= width; col += 8) {
+        const rgba_pixel *const px = &row_pixels[col];
+        const __m256i packed = _mm256_loadu_si256((const __m256i *)px);
+        const __m256 a = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(packed, 24)), max_alpha);
+        const __m256 r = _mm256_mul_ps(_mm256_setr_ps(gamma_lut[px[0].r], gamma_lut[px[1].r], gamma_lut[px[2].r], gamma_lut[px[3].r],
+                                                      gamma_lut[px[4].r], gamma_lut[px[5].r], gamma_lut[px[6].r], gamma_lut[px[7].r]), a);
+        const __m256 g = _mm256_mul_ps(_mm256_setr_ps(gamma_lut[px[0].g], gamma_lut[px[1].g], gamma_lut[px[2].g], gamma_lut[px[3].g],
+                                                      gamma_lut[px[4].g], gamma_lut[px[5].g], gamma_lut[px[6].g], gamma_lut[px[7].g]), a);
+        const __m256 b = _mm256_mul_ps(_mm256_setr_ps(gamma_lut[px[0].b], gamma_lut[px[1].b], gamma_lut[px[2].b], gamma_lut[px[3].b],
+                                                      gamma_lut[px[4].b], gamma_lut[px[5].b], gamma_lut[px[6].b], gamma_lut[px[7].b]), a);
+        // 4x4 transpose within each 128-bit lane gives pixels 0-3 in the low lanes and 4-7 in the high lanes
+        const __m256 ar_lo = _mm256_unpacklo_ps(a, r), ar_hi = _mm256_unpackhi_ps(a, r);
+        const __m256 gb_lo = _mm256_unpacklo_ps(g, b), gb_hi = _mm256_unpackhi_ps(g, b);
+        const __m256 p0 = _mm256_shuffle_ps(ar_lo, gb_lo, _MM_SHUFFLE(1,0,1,0));
+        const __m256 p1 = _mm256_shuffle_ps(ar_lo, gb_lo, _MM_SHUFFLE(3,2,3,2));
+        const __m256 p2 = _mm256_shuffle_ps(ar_hi, gb_hi, _MM_SHUFFLE(1,0,1,0));
+        const __m256 p3 = _mm256_shuffle_ps(ar_hi, gb_hi, _MM_SHUFFLE(3,2,3,2));
+        float *const out = (float *)&row_f_pixels[col];
+        _mm256_storeu_ps(out, _mm256_permute2f128_ps(p0, p1, 0x20));
+        _mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(p2, p3, 0x20));
+        _mm256_storeu_ps(out + 16, _mm256_permute2f128_ps(p0, p1, 0x31));
+        _mm256_storeu_ps(out + 24, _mm256_permute2f128_ps(p2, p3, 0x31));
+    }
+    return col;
+}
+#endif
+
 LIQ_NONNULL static void convert_row_to_f(liq_image *img, f_pixel *row_f_pixels, const unsigned int row, const float gamma_lut[])
 {
     assert(row_f_pixels);
@@ -809,7 +891,13 @@ LIQ_NONNULL static void convert_row_to_f(liq_image *img, f_pixel *row_f_pixels,
 
     const rgba_pixel *const row_pixels = liq_image_get_row_rgba(img, row);
 
-    for(unsigned int col=0; col < img->width; col++) {
+    unsigned int col=0;
+#if USE_AVX2
+    col = convert_row_to_f_avx2(row_f_pixels, row_pixels, img->width, gamma_lut);
+#elif USE_SSE
+    col = convert_row_to_f_sse(row_f_pixels, row_pixels, img->width, gamma_lut);
+#endif
+    for(; col < img->width; col++) {
         row_f_pixels[col] = rgba_to_f(gamma_lut, row_pixels[col]);
     }
 }
@@ -1035,6 +1123,20 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_set_dithering_level(liq_result *res, float
     return LIQ_OK;
 }
 
+LIQ_EXPORT LIQ_NONNULL liq_error liq_set_dithering_mode(liq_result *res, liq_dithering_mode mode)
+{
+    if (!CHECK_STRUCT_TYPE(res, liq_result)) return LIQ_INVALID_POINTER;
+    if (mode < LIQ_DITHER_FLOYD_STEINBERG || mode > LIQ_DITHER_BLUE_NOISE) return LIQ_VALUE_OUT_OF_RANGE;
+
+    if (res->remapping) {
+        liq_remapping_result_destroy(res->remapping);
+        res->remapping = NULL;
+    }
+
+    res->dither_mode = mode;
+    return LIQ_OK;
+}
+
 LIQ_NONNULL static liq_remapping_result *liq_remapping_result_create(liq_result *result)
 {
     if (!CHECK_STRUCT_TYPE(result, liq_result)) {
@@ -1048,6 +1150,7 @@ LIQ_NONNULL static liq_remapping_result *liq_remapping_result_create(liq_result
         .malloc = result->malloc,
         .free = result->free,
         .dither_level = result->dither_level,
+        .dither_mode = result->dither_mode,
         .use_dither_map = result->use_dither_map,
         .palette_error = result->palette_error,
         .gamma = result->gamma,
@@ -1089,6 +1192,9 @@ LIQ_EXPORT LIQ_NONNULL void liq_result_destroy(liq_result *res)
     }
 
     pam_freecolormap(res->palette);
+    if (res->index_map) {
+        res->free(res->index_map);
+    }
 
     res->magic_header = liq_freed_magic;
     res->free(res);
@@ -1253,7 +1359,167 @@ LIQ_EXPORT LIQ_NONNULL const liq_palette *liq_get_palette(liq_result *result)
     return &result->int_palette;
 }
 
-LIQ_NONNULL static float remap_to_palette(liq_image *const input_image, unsigned char *const *const output_pixels, colormap *const map)
+/*
+ * Per-thread cache of nearest colors, keyed on exact f_pixel value.
+ * Screenshots and UI graphics are made of relatively few unique colors, so most pixels that don't match
+ * the previous pixel's color can still skip the search.
+ * Photos hardly ever repeat a color, so the cache is abandoned once misses outnumber hits by more than its size.
+ */
+#define REMAP_CACHE_BITS 12
+#define REMAP_CACHE_SIZE (1u << REMAP_CACHE_BITS)
+
+typedef struct {
+    f_pixel color[REMAP_CACHE_SIZE];
+    float diff[REMAP_CACHE_SIZE];
+    unsigned char index[REMAP_CACHE_SIZE];
+    unsigned int hits, misses;
+} remap_cache;
+
+typedef union {
+    f_pixel px;
+    uint32_t bits[4];
+} f_pixel_bits;
+
+static void remap_cache_init(remap_cache *cache)
+{
+    cache->hits = cache->misses = 0;
+    for(unsigned int i=0; i < REMAP_CACHE_SIZE; i++) {
+        cache->color[i] = (f_pixel){.a = -1}; // never matches, alpha is >= 0
+    }
+}
+
+inline static uint32_t f_pixel_hash(const f_pixel px)
+{
+    const f_pixel_bits key = {.px = px};
+    uint32_t hash = key.bits[0];
+    hash = (hash ^ key.bits[1]) * 0x9E3779B1u;
+    hash = (hash ^ key.bits[2]) * 0x9E3779B1u;
+    hash = (hash ^ key.bits[3]) * 0x9E3779B1u;
+    return hash;
+}
+
+inline static bool f_pixel_same(const f_pixel a, const f_pixel b)
+{
+    const f_pixel_bits ka = {.px = a}, kb = {.px = b};
+    return ka.bits[0] == kb.bits[0] && ka.bits[1] == kb.bits[1] && ka.bits[2] == kb.bits[2] && ka.bits[3] == kb.bits[3];
+}
+
+inline static unsigned int remap_cache_slot(const f_pixel px)
+{
+    return f_pixel_hash(px) >> (32 - REMAP_CACHE_BITS);
+}
+
+inline static bool remap_cache_match(const remap_cache *cache, const unsigned int slot, const f_pixel px)
+{
+    return f_pixel_same(cache->color[slot], px);
+}
+
+/*
+ * All colors of the histogram, keyed on exact f_pixel value (open addressing), with their nearest palette entries.
+ * When the histogram wasn't posterized (ignorebits == 0) it has every color of the image,
+ * so non-dithered remapping becomes mostly a lookup.
+ * The palette is rounded and adjusted after quantization, so entries are matched again by each remap_to_palette.
+ */
+#define COLOR_INDEX_MAP_MAX_COLORS (1u << 16)
+
+struct color_index_map {
+    f_pixel *color;
+    float *diff;
+    unsigned char *index;
+    unsigned int bits, colors;
+};
+
+LIQ_NONNULL static struct color_index_map *color_index_map_create(const histogram *hist, void* (*malloc)(size_t))
+{
+    if (hist->ignorebits || !hist->size || hist->size > COLOR_INDEX_MAP_MAX_COLORS) {
+        return NULL;
+    }
+
+    unsigned int bits = 6;
+    while((1u << bits) < hist->size * 2) bits++;
+    const size_t slots = 1u << bits;
+
+    // single allocation, so it can be freed with result's free
+    const size_t header_size = (sizeof(struct color_index_map) + 15) & ~(size_t)15;
+    struct color_index_map *const index_map = malloc(header_size + slots * (sizeof(f_pixel) + sizeof(float) + 1));
+    if (!index_map) {
+        return NULL;
+    }
+    unsigned char *const data = (unsigned char *)index_map + header_size;
+    *index_map = (struct color_index_map){
+        .color = (f_pixel *)data,
+        .diff = (float *)(data + slots * sizeof(f_pixel)),
+        .index = data + slots * (sizeof(f_pixel) + sizeof(float)),
+        .bits = bits,
+        .colors = hist->size,
+    };
+    for(size_t i=0; i < slots; i++) {
+        index_map->color[i] = (f_pixel){.a = -1}; // empty, alpha is >= 0
+        index_map->index[i] = 0;
+    }
+
+    // histogram colors are unique, so there's no need to check for duplicates
+    for(unsigned int j=0; j < hist->size; j++) {
+        unsigned int slot = f_pixel_hash(hist->achv[j].acolor) >> (32 - bits);
+        while(index_map->color[slot].a >= 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        index_map->color[slot] = hist->achv[j].acolor;
+    }
+
+    return index_map;
+}
+
+/*
+ * Finds nearest entries of the palette that's about to be used. Previous matches are good guesses.
+ */
+LIQ_NONNULL static void color_index_map_match(struct color_index_map *index_map, const struct nearest_map *n)
+{
+    const int slots = 1 << index_map->bits;
+    f_pixel *const color = index_map->color;
+    float *const diff = index_map->diff;
+    unsigned char *const index = index_map->index;
+
+    #pragma omp parallel for if (index_map->colors > 5000) \
+        schedule(static) default(shared)
+    for(int i=0; i < slots; i++) {
+        if (color[i].a >= 0) {
+            index[i] = nearest_search(n, &color[i], index[i], &diff[i]);
+        }
+    }
+}
+
+inline static bool color_index_map_find(const struct color_index_map *index_map, const f_pixel px, unsigned int *index, float *diff)
+{
+    const unsigned int mask = (1u << index_map->bits) - 1;
+    for(unsigned int slot = f_pixel_hash(px) >> (32 - index_map->bits);; slot = (slot + 1) & mask) {
+        if (f_pixel_same(index_map->color[slot], px)) {
+            *index = index_map->index[slot];
+            *diff = index_map->diff[slot];
+            return true;
+        }
+        if (index_map->color[slot].a < 0) {
+            return false;
+        }
+    }
+}
+
+/*
+ * Like nearest_search, keeps the previous match when it's just as close as the one found
+ */
+inline static unsigned int prefer_last_match(const colormap_item acolormap[], const unsigned int last_match, const unsigned int match, const f_pixel px, float *diff)
+{
+    if (match != last_match) {
+        const float last_diff = colordifference(acolormap[last_match].acolor, px);
+        if (last_diff <= *diff) {
+            *diff = last_diff;
+            return last_match;
+        }
+    }
+    return match;
+}
+
+static float remap_to_palette(liq_image *const input_image, unsigned char *const *const output_pixels, colormap *const map, const double palette_error, struct color_index_map *index_map)
 {
     const int rows = input_image->height;
     const unsigned int cols = input_image->width;
@@ -1268,24 +1534,57 @@ LIQ_NONNULL static float remap_to_palette(liq_image *const input_image, unsigned
 
     const colormap_item *acolormap = map->palette;
 
-    struct nearest_map *const n = nearest_init(map);
+    struct nearest_map *const n = nearest_init(map, palette_error);
     const int transparent_index = input_image->background ? nearest_search(n, &(f_pixel){0,0,0,0}, 0, NULL) : 0;
 
+    // Matching histogram colors only pays off if the image has a few pixels of each (it could be another image)
+    if (index_map && index_map->colors * 4 <= rows*cols) {
+        color_index_map_match(index_map, n);
+    } else {
+        index_map = NULL;
+    }
 
     const unsigned int max_threads = omp_get_max_threads();
     LIQ_ARRAY(kmeans_state, average_color, (KMEANS_CACHE_LINE_GAP+map->colors) * max_threads);
     kmeans_init(map, max_threads, average_color);
 
+    // The cache is only an optimization, so remapping goes on without it if there's no memory
+    remap_cache *const caches = input_image->malloc(sizeof(caches[0]) * max_threads);
+    if (caches) {
+        for(unsigned int i=0; i < max_threads; i++) {
+            remap_cache_init(&caches[i]);
+        }
+    }
+
     #pragma omp parallel for if (rows*cols > 3000) \
-        schedule(static) default(none) shared(acolormap) shared(average_color) reduction(+:remapping_error)
+        schedule(static) default(shared) reduction(+:remapping_error)
     for(int row = 0; row < rows; ++row) {
         const f_pixel *const row_pixels = liq_image_get_row_f(input_image, row);
         const f_pixel *const bg_pixels = input_image->background && acolormap[transparent_index].acolor.a < 1.f/256.f ? liq_image_get_row_f(input_image->background, row) : NULL;
+        remap_cache *const cache = caches ? &caches[omp_get_thread_num()] : NULL;
 
         unsigned int last_match=0;
         for(unsigned int col = 0; col < cols; ++col) {
             float diff;
-            last_match = nearest_search(n, &row_pixels[col], last_match, &diff);
+            unsigned int match;
+            if (index_map && color_index_map_find(index_map, row_pixels[col], &match, &diff)) {
+                last_match = prefer_last_match(acolormap, last_match, match, row_pixels[col], &diff);
+            } else if (cache && cache->misses <= cache->hits + REMAP_CACHE_SIZE) {
+                const unsigned int slot = remap_cache_slot(row_pixels[col]);
+                if (remap_cache_match(cache, slot, row_pixels[col])) {
+                    diff = cache->diff[slot];
+                    last_match = prefer_last_match(acolormap, last_match, cache->index[slot], row_pixels[col], &diff);
+                    cache->hits++;
+                } else {
+                    last_match = nearest_search(n, &row_pixels[col], last_match, &diff);
+                    cache->misses++;
+                    cache->color[slot] = row_pixels[col];
+                    cache->diff[slot] = diff;
+                    cache->index[slot] = last_match;
+                }
+            } else {
+                last_match = nearest_search(n, &row_pixels[col], last_match, &diff);
+            }
             if (bg_pixels && colordifference(bg_pixels[col], acolormap[last_match].acolor) <= diff) {
                 last_match = transparent_index;
             }
@@ -1299,6 +1598,9 @@ LIQ_NONNULL static float remap_to_palette(liq_image *const input_image, unsigned
     kmeans_finalize(map, max_threads, average_color);
 
     nearest_free(n);
+    if (caches) {
+        input_image->free(caches);
+    }
 
     return remapping_error / (input_image->width * input_image->height);
 }
@@ -1349,6 +1651,10 @@ inline static f_pixel get_dithered_pixel(const float dither_level, const float m
   Uses edge/noise map to apply dithering only to flat areas. Dithering on edges creates jagged lines, and noisy areas are "naturally" dithered.
 
   If output_image_is_remapped is true, only pixels noticeably changed by error diffusion will be written to output image.
+
+  This is inherently serial: rows are remapped in zig-zag, so each row starts at the column where the previous one ended,
+  and needs that row's error terms (and last match, used as the guess) for it. There's no wavefront to run rows in parallel
+  without changing the output.
  */
 LIQ_NONNULL static bool remap_to_palette_floyd(liq_image *input_image, unsigned char *const output_pixels[], liq_remapping_result *quant, const float max_dither_error, const bool output_image_is_remapped)
 {
@@ -1373,7 +1679,7 @@ LIQ_NONNULL static bool remap_to_palette_floyd(liq_image *input_image, unsigned
     memset(thiserr, 0, errwidth * sizeof(thiserr[0]));
 
     bool ok = true;
-    struct nearest_map *const n = nearest_init(map);
+    struct nearest_map *const n = nearest_init(map, quant->palette_error);
     const int transparent_index = input_image->background ? nearest_search(n, &(f_pixel){0,0,0,0}, 0, NULL) : 0;
 
     // response to this value is non-linear and without it any value < 0.8 would give almost no dithering
@@ -1499,6 +1805,201 @@ LIQ_NONNULL static bool remap_to_palette_floyd(liq_image *input_image, unsigned
     return ok;
 }
 
+/* Bayer matrix, 64 levels */
+static const unsigned char bayer_matrix[8][8] = {
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+/* Blue noise made with void-and-cluster (sigma 1.5, wraps around), 256 levels */
+static const unsigned char blue_noise_matrix[32][32] = {
+    {56, 216, 81, 114, 175, 24, 139, 52, 211, 68, 240, 167, 27, 114, 8, 187, 128, 107, 143, 35, 254, 186, 43, 220, 196, 153, 93, 202, 67, 255, 151, 115},
+    {134, 238, 158, 50, 241, 98, 195, 252, 33, 183, 110, 83, 226, 139, 245, 89, 47, 241, 58, 166, 76, 106, 136, 63, 116, 38, 231, 15, 117, 211, 2, 189},
+    {31, 95, 14, 187, 68, 151, 9, 78, 155, 130, 6, 201, 45, 175, 71, 204, 159, 13, 184, 214, 7, 203, 234, 176, 12, 188, 75, 135, 178, 51, 104, 72},
+    {179, 208, 121, 229, 32, 213, 123, 221, 99, 237, 61, 161, 97, 18, 123, 35, 220, 103, 81, 122, 152, 55, 29, 86, 146, 219, 100, 245, 24, 155, 218, 244},
+    {146, 48, 76, 144, 105, 174, 56, 19, 187, 40, 209, 143, 252, 216, 186, 147, 64, 134, 228, 39, 243, 102, 164, 249, 125, 45, 164, 59, 197, 87, 124, 13},
+    {101, 167, 250, 5, 196, 87, 247, 138, 163, 86, 118, 28, 74, 51, 108, 6, 247, 171, 21, 190, 70, 133, 200, 19, 69, 204, 4, 111, 229, 34, 171, 64},
+    {236, 23, 129, 212, 44, 156, 27, 72, 217, 0, 234, 189, 132, 165, 233, 89, 197, 54, 96, 156, 1, 222, 44, 180, 96, 239, 150, 181, 77, 140, 221, 191},
+    {41, 84, 181, 64, 99, 231, 125, 201, 110, 52, 171, 94, 15, 202, 42, 154, 26, 116, 213, 237, 120, 88, 148, 111, 213, 36, 127, 21, 253, 55, 9, 116},
+    {202, 140, 226, 117, 167, 11, 182, 36, 238, 148, 211, 65, 246, 114, 80, 226, 130, 180, 75, 40, 174, 59, 251, 11, 165, 57, 87, 194, 106, 209, 91, 158},
+    {246, 2, 56, 28, 254, 82, 145, 62, 96, 17, 129, 37, 160, 140, 3, 208, 61, 255, 10, 143, 206, 25, 192, 80, 234, 135, 218, 155, 42, 173, 131, 62},
+    {169, 101, 215, 153, 199, 43, 221, 191, 162, 249, 79, 195, 229, 53, 186, 104, 31, 162, 109, 224, 93, 131, 159, 116, 30, 178, 7, 70, 236, 16, 225, 29},
+    {76, 188, 130, 66, 92, 137, 109, 4, 121, 33, 178, 105, 22, 91, 242, 169, 133, 78, 195, 21, 63, 245, 46, 207, 65, 103, 245, 119, 143, 85, 197, 113},
+    {232, 42, 15, 237, 182, 20, 235, 71, 200, 225, 59, 136, 206, 151, 69, 15, 223, 49, 239, 150, 185, 108, 3, 231, 147, 189, 49, 205, 31, 177, 51, 148},
+    {128, 200, 161, 107, 37, 211, 166, 45, 145, 90, 168, 7, 223, 44, 121, 199, 97, 176, 115, 38, 83, 219, 174, 122, 81, 17, 166, 95, 223, 108, 250, 10},
+    {94, 60, 247, 77, 149, 126, 84, 243, 111, 25, 254, 118, 78, 179, 247, 34, 146, 5, 212, 138, 19, 157, 61, 31, 200, 252, 127, 62, 0, 160, 73, 210},
+    {22, 172, 120, 2, 229, 58, 191, 10, 159, 205, 52, 188, 28, 101, 158, 66, 234, 88, 53, 253, 191, 95, 241, 144, 102, 40, 148, 235, 190, 134, 40, 182},
+    {152, 220, 39, 204, 179, 30, 101, 219, 68, 132, 88, 149, 235, 135, 11, 215, 185, 128, 170, 69, 123, 41, 204, 8, 221, 186, 74, 20, 89, 217, 117, 239},
+    {56, 100, 139, 82, 112, 252, 137, 174, 38, 240, 4, 216, 61, 193, 85, 46, 104, 29, 206, 11, 225, 164, 76, 129, 59, 170, 115, 207, 153, 53, 27, 84},
+    {201, 12, 242, 169, 47, 156, 14, 88, 193, 118, 171, 106, 37, 124, 251, 165, 144, 240, 80, 155, 98, 24, 183, 237, 93, 16, 242, 37, 106, 255, 184, 142},
+    {109, 177, 68, 21, 225, 72, 214, 54, 227, 26, 77, 199, 157, 16, 210, 71, 0, 194, 118, 50, 248, 114, 146, 44, 212, 160, 135, 194, 65, 161, 4, 226},
+    {34, 216, 149, 119, 196, 105, 131, 163, 98, 145, 248, 50, 232, 94, 180, 112, 57, 227, 33, 177, 209, 62, 193, 2, 124, 54, 82, 25, 232, 91, 123, 73},
+    {134, 52, 95, 249, 32, 173, 1, 243, 41, 181, 9, 129, 64, 142, 26, 241, 136, 161, 92, 126, 22, 84, 227, 107, 251, 176, 223, 112, 172, 46, 192, 244},
+    {170, 203, 8, 185, 60, 86, 207, 69, 120, 219, 90, 208, 172, 222, 42, 203, 80, 13, 192, 218, 141, 168, 36, 157, 74, 20, 202, 141, 10, 212, 150, 19},
+    {115, 71, 233, 126, 158, 230, 139, 188, 24, 157, 47, 110, 18, 78, 120, 165, 105, 255, 51, 73, 7, 244, 98, 215, 132, 47, 97, 66, 249, 103, 58, 87},
+    {242, 23, 144, 45, 100, 17, 39, 109, 235, 79, 197, 250, 151, 193, 236, 58, 23, 177, 147, 231, 113, 183, 63, 16, 189, 238, 154, 183, 34, 130, 224, 184},
+    {154, 214, 82, 199, 222, 180, 254, 57, 172, 6, 137, 63, 35, 99, 3, 142, 224, 125, 35, 94, 198, 48, 138, 162, 85, 117, 13, 208, 79, 169, 0, 41},
+    {60, 107, 173, 5, 66, 124, 86, 150, 213, 93, 228, 182, 127, 168, 210, 90, 184, 67, 214, 159, 25, 121, 207, 253, 33, 222, 55, 138, 230, 111, 201, 133},
+    {190, 29, 244, 136, 166, 30, 206, 14, 127, 43, 113, 22, 238, 50, 72, 248, 39, 112, 12, 246, 74, 228, 6, 103, 70, 195, 167, 97, 27, 67, 251, 90},
+    {230, 122, 53, 91, 233, 108, 178, 75, 246, 160, 198, 79, 154, 194, 122, 14, 163, 205, 133, 89, 175, 145, 57, 181, 149, 113, 9, 243, 152, 48, 163, 12},
+    {73, 176, 209, 18, 153, 49, 217, 141, 32, 60, 218, 5, 104, 30, 220, 140, 99, 239, 54, 192, 32, 110, 203, 28, 230, 46, 210, 77, 187, 119, 215, 137},
+    {43, 102, 142, 250, 70, 190, 1, 102, 233, 185, 92, 131, 253, 179, 85, 49, 173, 75, 1, 156, 217, 67, 240, 132, 81, 175, 125, 23, 228, 100, 20, 198},
+    {164, 8, 196, 36, 128, 227, 83, 168, 119, 18, 147, 48, 205, 65, 152, 232, 26, 198, 224, 92, 126, 17, 162, 96, 3, 248, 55, 141, 170, 38, 83, 236}
+};
+
+inline static float ordered_dither_threshold(const liq_dithering_mode mode, const unsigned int row, const unsigned int col)
+{
+    if (mode == LIQ_DITHER_BAYER) {
+        return (bayer_matrix[row & 7][col & 7] + 0.5f) * (1.f/64.f);
+    }
+    return (blue_noise_matrix[row & 31][col & 31] + 0.5f) * (1.f/256.f);
+}
+
+/*
+ * The two palette colors a pixel is mixed from: the nearest one, and the nearest one on the other side of the pixel.
+ * ratio is how far the pixel is from the nearest color towards the other one (0 to 0.5).
+ * The other color is only searched for when the threshold may pick it.
+ */
+typedef struct {
+    f_pixel px;
+    float near_diff, ratio;
+    unsigned int near, far;
+    bool has_far;
+} ordered_dither_pair;
+
+inline static void ordered_dither_pair_near(const struct nearest_map *n, const f_pixel px, const unsigned int guessed_match, ordered_dither_pair *pair)
+{
+    pair->px = px;
+    pair->near = nearest_search(n, &px, guessed_match, &pair->near_diff);
+    pair->has_far = false;
+}
+
+inline static void ordered_dither_pair_far(const struct nearest_map *n, const colormap_item acolormap[], ordered_dither_pair *pair)
+{
+    pair->has_far = true;
+    pair->ratio = 0;
+    if (pair->near_diff <= 0) {
+        return;
+    }
+
+    // Go from the nearest color through the pixel, at least as far as the nearest other palette color is,
+    // otherwise pixels close to a palette color would never find a color to mix with
+    const f_pixel px = pair->px, near = acolormap[pair->near].acolor;
+    const float scale = MAX(2.f, sqrtf(nearest_other_color_diff(n, pair->near) / pair->near_diff));
+    const f_pixel target = {
+        .a = near.a + (px.a - near.a) * scale,
+        .r = near.r + (px.r - near.r) * scale,
+        .g = near.g + (px.g - near.g) * scale,
+        .b = near.b + (px.b - near.b) * scale,
+    };
+    pair->far = nearest_search(n, &target, pair->far, NULL); // neighbors likely have the same far color
+    if (pair->far == pair->near) {
+        return;
+    }
+
+    const f_pixel far = acolormap[pair->far].acolor;
+    const float da = far.a - near.a, dr = far.r - near.r, dg = far.g - near.g, db = far.b - near.b;
+    const float length = da*da + dr*dr + dg*dg + db*db;
+    if (length > 0) {
+        const float projection = (px.a - near.a)*da + (px.r - near.r)*dr + (px.g - near.g)*dg + (px.b - near.b)*db;
+        pair->ratio = MAX(0.f, MIN(0.5f, projection / length));
+    }
+}
+
+/**
+  Ordered dithering: each pixel picks one of its two closest palette colors, by comparing how far it is between them
+  with a threshold from a matrix tiled over the image. There's no error carried between pixels, so rows are remapped in parallel.
+  Like Floyd-Steinberg, it uses the edge/noise map to apply dithering only to flat areas.
+
+  Progress is reported (and abort checked) only by the calling thread, which is thread 0, with its share of rows as the fraction done.
+ */
+LIQ_NONNULL static liq_error remap_to_palette_ordered(liq_image *input_image, unsigned char *const output_pixels[], liq_remapping_result *quant, const bool output_image_is_remapped)
+{
+    const int rows = input_image->height;
+    const unsigned int cols = input_image->width;
+    const unsigned char *dither_map = quant->use_dither_map ? (input_image->dither_map ? input_image->dither_map : input_image->edges) : NULL;
+    const liq_dithering_mode mode = quant->dither_mode;
+
+    if (!liq_image_get_row_f_init(input_image)) {
+        return LIQ_OUT_OF_MEMORY;
+    }
+    if (input_image->background && !liq_image_get_row_f_init(input_image->background)) {
+        return LIQ_OUT_OF_MEMORY;
+    }
+
+    const colormap_item *acolormap = quant->palette->palette;
+    struct nearest_map *const n = nearest_init(quant->palette, quant->palette_error);
+    const int transparent_index = input_image->background ? nearest_search(n, &(f_pixel){0,0,0,0}, 0, NULL) : 0;
+
+    // same response curve as Floyd-Steinberg
+    float base_dithering_level = quant->dither_level;
+    base_dithering_level = 1.f - (1.f-base_dithering_level)*(1.f-base_dithering_level);
+    if (dither_map) {
+        base_dithering_level *= 1.f/255.f; // convert byte to float
+    }
+
+    bool aborted = false;
+    #pragma omp parallel for if (rows*cols > 3000) \
+        schedule(static) default(shared)
+    for(int row = 0; row < rows; ++row) {
+        bool skip;
+        #pragma omp atomic read
+        skip = aborted;
+        if (skip) continue;
+
+        if (omp_get_thread_num() == 0) {
+            const float done = MIN(1.f, (float)row * omp_get_num_threads() / rows);
+            if (liq_remap_progress(quant, quant->progress_stage1 + done * (100.f - quant->progress_stage1))) {
+                #pragma omp atomic write
+                aborted = true;
+                continue;
+            }
+        }
+
+        const f_pixel *const row_pixels = liq_image_get_row_f(input_image, row);
+        const f_pixel *const bg_pixels = input_image->background && acolormap[transparent_index].acolor.a < 1.f/256.f ? liq_image_get_row_f(input_image->background, row) : NULL;
+
+        ordered_dither_pair pair = {.near = 0, .far = 0};
+        for(unsigned int col = 0; col < cols; ++col) {
+            // areas of the same color are common, and need the same pair
+            if (col == 0 || row_pixels[col].a != pair.px.a || row_pixels[col].r != pair.px.r || row_pixels[col].g != pair.px.g || row_pixels[col].b != pair.px.b) {
+                ordered_dither_pair_near(n, row_pixels[col], output_image_is_remapped ? output_pixels[row][col] : pair.near, &pair);
+            }
+
+            float dither_level = base_dithering_level;
+            if (dither_map) {
+                dither_level *= dither_map[row*cols + col];
+            }
+
+            unsigned int match = pair.near;
+            float diff = pair.near_diff;
+            const float threshold = ordered_dither_threshold(mode, row, col);
+            if (dither_level * 0.5f > threshold) {
+                if (!pair.has_far) {
+                    ordered_dither_pair_far(n, acolormap, &pair);
+                }
+                if (pair.ratio * dither_level > threshold) {
+                    match = pair.far;
+                    diff = colordifference(acolormap[match].acolor, row_pixels[col]);
+                }
+            }
+            if (bg_pixels && colordifference(bg_pixels[col], acolormap[match].acolor) <= diff) {
+                match = transparent_index;
+            }
+            output_pixels[row][col] = match;
+        }
+    }
+
+    nearest_free(n);
+    return aborted ? LIQ_ABORTED : LIQ_OK;
+}
+
 /* fixed colors are always included in the palette, so it would be wasteful to duplicate them in palette from histogram */
 LIQ_NONNULL static void remove_fixed_colors_from_histogram(histogram *hist, const int fixed_colors_count, const f_pixel fixed_colors[], const float target_mse)
 {
@@ -1543,7 +2044,6 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_histogram_add_colors(liq_histogram *input_h
     }
     input_hist->acht->rows += num_entries;
 
-    const unsigned int hash_size = input_hist->acht->hash_size;
     for(int i=0; i < num_entries; i++) {
         const rgba_pixel rgba = {
             .r = entries[i].color.r,
@@ -1552,13 +2052,10 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_histogram_add_colors(liq_histogram *input_h
             .a = entries[i].color.a,
         };
         union rgba_as_int px = {rgba};
-        unsigned int hash;
-        if (px.rgba.a) {
-            hash = px.l % hash_size;
-        } else {
-            hash=0; px.l=0;
+        if (!px.rgba.a) {
+            px.l=0;
         }
-        if (!pam_add_to_hash(input_hist->acht, hash, entries[i].count, px, i, num_entries)) {
+        if (!pam_add_to_hash(input_hist->acht, entries[i].count, px)) {
             return LIQ_OUT_OF_MEMORY;
         }
     }
@@ -1566,6 +2063,134 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_histogram_add_colors(liq_histogram *input_h
     return LIQ_OK;
 }
 
+/*
+ * Adds rows one by one, and when there are too many colors, posterizes colors counted so far and carries on with the next row.
+ * Colors are posterized only when even a part of the image has too many of them, so the result is the same as counting
+ * the whole image again with each higher ignorebits until its colors fit.
+ */
+static bool add_rows_to_acolorhash(struct acolorhash_table *acht, const rgba_pixel *const rows[], const unsigned int cols, const unsigned int first_row, const unsigned int num_rows, const unsigned int sample_stride, const unsigned char *importance_map)
+{
+    for(unsigned int row = 0; row < num_rows; row++) {
+        if (!pam_computeacolorhash(acht, &rows[row], cols, 1, first_row + row, sample_stride, importance_map ? &importance_map[row * cols] : NULL)) {
+            return false;
+        }
+        if (acht->colors > acht->maxcolors && !pam_limitacolorhash(acht)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Counts colors of a large image on all threads, each into its own table for a band of rows.
+ * Tables are merged in order of rows, so the result is exactly the same as counting on one thread.
+ */
+LIQ_NONNULL static bool compute_acolorhash(struct acolorhash_table *acht, const liq_image *input_image, const unsigned int sample_stride, const unsigned int max_histogram_entries)
+{
+    const rgba_pixel *const *const rows = (const rgba_pixel *const *)input_image->rows;
+    const unsigned int cols = input_image->width, height = input_image->height;
+    const int bands = MIN(omp_get_max_threads(), height / 64);
+
+    if (bands < 2 || cols * height < 1024*1024) {
+        return add_rows_to_acolorhash(acht, rows, cols, 0, height, sample_stride, input_image->importance_map);
+    }
+
+    // the first band goes straight to the histogram
+    LIQ_ARRAY(struct acolorhash_table *, tables, bands);
+    tables[0] = acht;
+    bool ok = true;
+    for(int i=1; i < bands; i++) {
+        // sized for the band's own pixels, the histogram already has room for the whole image
+        const unsigned int start = height * i / bands, end = height * (i+1) / bands;
+        tables[i] = pam_allocacolorhash(max_histogram_entries, (end - start) * cols / sample_stride, acht->ignorebits, input_image->malloc, input_image->free);
+        ok = ok && tables[i];
+    }
+
+    if (ok) {
+        #pragma omp parallel for schedule(static, 1) default(shared) reduction(&&:ok)
+        for(int i=0; i < bands; i++) {
+            const unsigned int start = height * i / bands, end = height * (i+1) / bands;
+            const unsigned char *const importance_map = input_image->importance_map ? &input_image->importance_map[start * cols] : NULL;
+            ok = add_rows_to_acolorhash(tables[i], &rows[start], cols, start, end - start, sample_stride, importance_map) && ok;
+        }
+    }
+
+    for(int i=1; i < bands; i++) {
+        if (tables[i]) {
+            ok = ok && pam_mergeacolorhash(acht, tables[i]) && pam_limitacolorhash(acht);
+            pam_freeacolorhash(tables[i]);
+        }
+    }
+    return ok;
+}
+
+/*
+ * Counts colors in a sample of the image to guess up front how much they have to be posterized
+ * to fit in max_histogram_entries, rather than finding out by counting the whole image again after each failure.
+ * A guess that is too low only costs the usual retry.
+ */
+LIQ_NONNULL static unsigned int predict_histogram_ignorebits(liq_image *input_image, const unsigned int sample_stride, unsigned int ignorebits, const unsigned int max_histogram_entries)
+{
+    const unsigned int cols = input_image->width, rows = input_image->height;
+    const double counted_pixels = (double)cols * rows / sample_stride;
+    const unsigned int sample_rows = MIN(rows, 512), sample_cols = MIN(cols, 512);
+    const unsigned int quarter = sample_rows * sample_cols / 4;
+
+    // Smaller images are counted quickly enough. Counting stops as soon as there are too many colors,
+    // so with a low limit a failed attempt costs less than the prediction.
+    if ((double)cols * rows < 1024*1024 || counted_pixels < 16.0 * quarter || max_histogram_entries < 4 * quarter) {
+        return ignorebits;
+    }
+
+    rgba_pixel *const sample = input_image->malloc(sizeof(sample[0]) * quarter * 4);
+    if (!sample) {
+        return ignorebits;
+    }
+    for(unsigned int i=0; i < sample_rows; i++) {
+        const rgba_pixel *const row_pixels = liq_image_get_row_rgba(input_image, rows * i / sample_rows);
+        for(unsigned int j=0; j < sample_cols; j++) {
+            const unsigned int n = i * sample_cols + j;
+            if (n >= quarter * 4) break;
+            // samples are dealt out to quarters in turn, so that each quarter covers the whole image
+            const unsigned int start = cols * j / sample_cols, end = cols * (j+1) / sample_cols;
+            sample[(n & 3) * quarter + n/4] = row_pixels[start + (i * 31 + j * 17) % (end - start)];
+        }
+    }
+
+    for(; ignorebits < 7; ignorebits++) {
+        struct acolorhash_table *acht = pam_allocacolorhash(~0, quarter * 4, ignorebits, input_image->malloc, input_image->free);
+        if (!acht) break;
+
+        // colors in 1/4, 1/2 and all of the sample
+        const rgba_pixel *const parts[3] = {sample, sample + quarter, sample + 2*quarter};
+        const unsigned int part_sizes[3] = {quarter, quarter, 2*quarter};
+        double colors[3];
+        bool ok = true;
+        for(int i=0; i < 3; i++) {
+            ok = ok && pam_computeacolorhash(acht, &parts[i], part_sizes[i], 1, 0, 1, NULL);
+            colors[i] = acht->colors;
+        }
+        pam_freeacolorhash(acht);
+        if (!ok) break;
+
+        // Every doubling of pixels multiplies colors by 2^growth. Growth slows down as colors start repeating,
+        // and it's assumed to keep slowing down at the same pace until all pixels are counted.
+        const double last_growth = log2(colors[2] / colors[1]);
+        const double slowdown = MAX(0, log2(colors[1] / colors[0]) - last_growth);
+        double estimated_colors = colors[2], growth = last_growth;
+        // capped so that the loop always ends
+        for(double doublings = MIN(32, log2(counted_pixels / (4.0 * quarter))); doublings > 0; doublings -= 1) {
+            growth = MAX(0, growth - slowdown);
+            estimated_colors *= pow(2, growth * MIN(1, doublings));
+        }
+        if (estimated_colors <= max_histogram_entries) {
+            break;
+        }
+    }
+    input_image->free(sample);
+    return ignorebits;
+}
+
 LIQ_EXPORT LIQ_NONNULL liq_error liq_histogram_add_image(liq_histogram *input_hist, const liq_attr *options, liq_image *input_image)
 {
     if (!CHECK_STRUCT_TYPE(options, liq_attr)) return LIQ_INVALID_POINTER;
@@ -1589,8 +2214,8 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_histogram_add_image(liq_histogram *input_hi
 
     /*
      ** Step 2: attempt to make a histogram of the colors, unclustered.
-     ** If at first we don't succeed, increase ignorebits to increase color
-     ** coherence and try again.
+     ** If there are too many colors, increase ignorebits to increase color
+     ** coherence and carry on.
      */
 
     if (liq_progress(options, options->progress_stage1 * 0.4f)) {
@@ -1599,36 +2224,45 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_histogram_add_image(liq_histogram *input_hi
 
     const bool all_rows_at_once = liq_image_can_use_rgba_rows(input_image);
 
-    // Usual solution is to start from scratch when limit is exceeded, but that's not possible if it's not
-    // the first image added
+    // the limit applies only to the first image added
     const unsigned int max_histogram_entries = input_hist->had_image_added ? ~0 : options->max_histogram_entries;
-    do {
-        if (!input_hist->acht) {
-            input_hist->acht = pam_allocacolorhash(max_histogram_entries, rows*cols, input_hist->ignorebits, options->malloc, options->free);
+
+    // very large images are counted from a sample of pixels
+    const unsigned int sample_stride = MAX(1, (unsigned int)ceil((double)rows * cols / options->max_histogram_samples));
+    if (sample_stride > 1) {
+        liq_verbose_printf(options, "  counting colors of 1 in %u pixels", sample_stride);
+    }
+
+    if (!input_hist->had_image_added && !input_hist->acht) {
+        const unsigned int ignorebits = predict_histogram_ignorebits(input_image, sample_stride, input_hist->ignorebits, max_histogram_entries);
+        if (ignorebits != input_hist->ignorebits) {
+            input_hist->ignorebits = ignorebits;
+            liq_verbose_printf(options, "  too many colors in a sample! Scaling colors to improve clustering... %d", input_hist->ignorebits);
         }
+    }
+
+    if (!input_hist->acht) {
+        input_hist->acht = pam_allocacolorhash(max_histogram_entries, rows*cols/sample_stride, input_hist->ignorebits, options->malloc, options->free);
         if (!input_hist->acht) return LIQ_OUT_OF_MEMORY;
+    }
 
-        // histogram uses noise contrast map for importance. Color accuracy in noisy areas is not very important.
-        // noise map does not include edges to avoid ruining anti-aliasing
-        for(unsigned int row=0; row < rows; row++) {
-            bool added_ok;
-            if (all_rows_at_once) {
-                added_ok = pam_computeacolorhash(input_hist->acht, (const rgba_pixel *const *)input_image->rows, cols, rows, input_image->importance_map);
-                if (added_ok) break;
-            } else {
-                const rgba_pixel* rows_p[1] = { liq_image_get_row_rgba(input_image, row) };
-                added_ok = pam_computeacolorhash(input_hist->acht, rows_p, cols, 1, input_image->importance_map ? &input_image->importance_map[row * cols] : NULL);
-            }
-            if (!added_ok) {
-                input_hist->ignorebits++;
-                liq_verbose_printf(options, "  too many colors! Scaling colors to improve clustering... %d", input_hist->ignorebits);
-                pam_freeacolorhash(input_hist->acht);
-                input_hist->acht = NULL;
-                if (liq_progress(options, options->progress_stage1 * 0.6f)) return LIQ_ABORTED;
-                break;
-            }
+    // histogram uses noise contrast map for importance. Color accuracy in noisy areas is not very important.
+    // noise map does not include edges to avoid ruining anti-aliasing
+    bool added_ok = true;
+    if (all_rows_at_once) {
+        added_ok = compute_acolorhash(input_hist->acht, input_image, sample_stride, max_histogram_entries);
+    } else {
+        for(unsigned int row=0; row < rows && added_ok; row++) {
+            const rgba_pixel* rows_p[1] = { liq_image_get_row_rgba(input_image, row) };
+            added_ok = add_rows_to_acolorhash(input_hist->acht, rows_p, cols, row, 1, sample_stride, input_image->importance_map ? &input_image->importance_map[row * cols] : NULL);
         }
-    } while(!input_hist->acht);
+    }
+    if (!added_ok) return LIQ_OUT_OF_MEMORY;
+
+    if (input_hist->acht->ignorebits != input_hist->ignorebits) {
+        input_hist->ignorebits = input_hist->acht->ignorebits;
+        liq_verbose_printf(options, "  too many colors! Scaling colors to improve clustering... %d", input_hist->ignorebits);
+    }
 
     input_hist->had_image_added = true;
 
@@ -1688,6 +2322,69 @@ LIQ_NONNULL static void modify_alpha(liq_image *input_image, rgba_pixel *const r
     }
 }
 
+/**
+ One row of contrast_maps. Rows above and below are clamped by the caller.
+ */
+LIQ_NONNULL static void contrast_maps_row(const f_pixel *prev_row, const f_pixel *curr_row, const f_pixel *next_row, const unsigned int cols, unsigned char *restrict noise_row, unsigned char *restrict edges_row)
+{
+#if USE_SSE
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 prev, curr = _mm_load_ps((const float *)&curr_row[0]), next = curr;
+#else
+    f_pixel prev, curr = curr_row[0], next=curr;
+#endif
+    for (unsigned int i=0; i < cols; i++) {
+        float horiz, vert;
+#if USE_SSE
+        prev=curr;
+        curr=next;
+        next = _mm_load_ps((const float *)&curr_row[MIN(cols-1,i+1)]);
+
+        // contrast is difference between pixels neighbouring horizontally and vertically, all channels at once
+        const __m128 curr2 = _mm_add_ps(curr, curr);
+        const __m128 h = _mm_and_ps(abs_mask, _mm_sub_ps(_mm_add_ps(prev, next), curr2));
+        const __m128 v = _mm_and_ps(abs_mask, _mm_sub_ps(_mm_add_ps(_mm_load_ps((const float *)&prev_row[i]), _mm_load_ps((const float *)&next_row[i])), curr2));
+
+        // max of channels, horizontal in lane 0 and vertical in lane 1
+        __m128 max = _mm_max_ps(_mm_unpacklo_ps(h, v), _mm_unpackhi_ps(h, v));
+        max = _mm_max_ps(max, _mm_movehl_ps(max, max));
+        horiz = _mm_cvtss_f32(max);
+        vert = _mm_cvtss_f32(_mm_shuffle_ps(max, max, 1));
+#else
+        prev=curr;
+        curr=next;
+        next = curr_row[MIN(cols-1,i+1)];
+
+        // contrast is difference between pixels neighbouring horizontally and vertically
+        const float a = fabsf(prev.a+next.a - curr.a*2.f),
+                    r = fabsf(prev.r+next.r - curr.r*2.f),
+                    g = fabsf(prev.g+next.g - curr.g*2.f),
+                    b = fabsf(prev.b+next.b - curr.b*2.f);
+
+        const f_pixel prevl = prev_row[i];
+        const f_pixel nextl = next_row[i];
+
+        const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
+                    r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
+                    g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
+                    b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
+
+        horiz = MAX(MAX(a,r),MAX(g,b));
+        vert = MAX(MAX(a1,r1),MAX(g1,b1));
+#endif
+        const float edge = MAX(horiz,vert);
+        float z = edge - fabsf(horiz-vert)*.5f;
+        z = 1.f - MAX(z,MIN(horiz,vert));
+        z *= z; // noise is amplified
+        z *= z;
+        // 85 is about 1/3rd of weight (not 0, because noisy pixels still need to be included, just not as precisely).
+        const unsigned int z_int = 85 + (unsigned int)(z * 171.f);
+        noise_row[i] = MIN(z_int, 255);
+        const int e_int = 255 - (int)(edge * 256.f);
+        edges_row[i] = e_int > 0 ? MIN(e_int, 255) : 0;
+    }
+}
+
 /**
  Builds two maps:
     importance_map - approximation of areas with high-frequency noise, except straight edges. 1=flat, 0=noisy.
@@ -1714,46 +2411,24 @@ LIQ_NONNULL static void contrast_maps(liq_image *image)
         return;
     }
 
-    const f_pixel *curr_row, *prev_row, *next_row;
-    curr_row = prev_row = next_row = liq_image_get_row_f(image, 0);
-
-    for (unsigned int j=0; j < rows; j++) {
-        prev_row = curr_row;
-        curr_row = next_row;
-        next_row = liq_image_get_row_f(image, MIN(rows-1,j+1));
-
-        f_pixel prev, curr = curr_row[0], next=curr;
-        for (unsigned int i=0; i < cols; i++) {
-            prev=curr;
-            curr=next;
-            next = curr_row[MIN(cols-1,i+1)];
-
-            // contrast is difference between pixels neighbouring horizontally and vertically
-            const float a = fabsf(prev.a+next.a - curr.a*2.f),
-                        r = fabsf(prev.r+next.r - curr.r*2.f),
-                        g = fabsf(prev.g+next.g - curr.g*2.f),
-                        b = fabsf(prev.b+next.b - curr.b*2.f);
-
-            const f_pixel prevl = prev_row[i];
-            const f_pixel nextl = next_row[i];
-
-            const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
-                        r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
-                        g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
-                        b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
-
-            const float horiz = MAX(MAX(a,r),MAX(g,b));
-            const float vert = MAX(MAX(a1,r1),MAX(g1,b1));
-            const float edge = MAX(horiz,vert);
-            float z = edge - fabsf(horiz-vert)*.5f;
-            z = 1.f - MAX(z,MIN(horiz,vert));
-            z *= z; // noise is amplified
-            z *= z;
-            // 85 is about 1/3rd of weight (not 0, because noisy pixels still need to be included, just not as precisely).
-            const unsigned int z_int = 85 + (unsigned int)(z * 171.f);
-            noise[j*cols+i] = MIN(z_int, 255);
-            const int e_int = 255 - (int)(edge * 256.f);
-            edges[j*cols+i] = e_int > 0 ? MIN(e_int, 255) : 0;
+    if (image->f_pixels) {
+        #pragma omp parallel for if (rows*cols > 50000) \
+            schedule(static) default(shared)
+        for (unsigned int j=0; j < rows; j++) {
+            contrast_maps_row(liq_image_get_row_f(image, j > 0 ? j-1 : 0), liq_image_get_row_f(image, j), liq_image_get_row_f(image, MIN(rows-1,j+1)),
+                              cols, &noise[j*cols], &edges[j*cols]);
+        }
+    } else {
+        // in low memory mode rows are converted on the fly into the same buffer, so they're processed in order
+        const f_pixel *curr_row, *prev_row, *next_row;
+        curr_row = prev_row = next_row = liq_image_get_row_f(image, 0);
+
+        for (unsigned int j=0; j < rows; j++) {
+            prev_row = curr_row;
+            curr_row = next_row;
+            next_row = liq_image_get_row_f(image, MIN(rows-1,j+1));
+
+            contrast_maps_row(prev_row, curr_row, next_row, cols, &noise[j*cols], &edges[j*cols]);
         }
     }
 
@@ -1865,6 +2540,9 @@ LIQ_NONNULL static void adjust_histogram_callback(hist_item *item, float diff)
  Repeats mediancut with different histogram weights to find palette with minimum error.
 
  feedback_loop_trials controls how long the search will take. < 0 skips the iteration.
+
+ If speculative_trials > 1, every round tries that many variants of the weights and target at once,
+ each in its own copy of the histogram, and continues from the best one.
  */
 static colormap *find_best_palette(histogram *hist, const liq_attr *options, const double max_mse, const f_pixel fixed_colors[], const unsigned int fixed_colors_count, double *palette_error_p)
 {
@@ -1883,59 +2561,127 @@ static colormap *find_best_palette(histogram *hist, const liq_attr *options, con
     double target_mse_overshoot = feedback_loop_trials>0 ? 1.05 : 1.0;
     const float total_trials = (float)(feedback_loop_trials>0?feedback_loop_trials:1);
 
+    // the first variant uses the histogram itself, others need copies
+    unsigned int variants = options->speculative_trials;
+    hist_item *copies = NULL;
+    if (variants > 1 && feedback_loop_trials > 0 && hist->size) {
+        copies = options->malloc(sizeof(hist->achv[0]) * hist->size * (variants-1));
+    }
+    if (!copies) {
+        variants = 1;
+    }
+    LIQ_ARRAY(histogram, trial_hist, variants);
+    LIQ_ARRAY(colormap*, trial_map, variants);
+    LIQ_ARRAY(double, trial_error, variants);
+    LIQ_ARRAY(double, trial_overshoot, variants);
+
     do {
-        colormap *newmap;
-        if (hist->size && fixed_colors_count < max_colors) {
-            newmap = mediancut(hist, max_colors-fixed_colors_count, target_mse * target_mse_overshoot, MAX(MAX(45.0/65536.0, target_mse), least_error)*1.2,
-                               options->malloc, options->free);
-        } else {
+        if (!hist->size || fixed_colors_count >= max_colors) {
             feedback_loop_trials = 0;
-            newmap = NULL;
-        }
-        newmap = add_fixed_colors_to_palette(newmap, max_colors, fixed_colors, fixed_colors_count, options->malloc, options->free);
-        if (!newmap) {
-            return NULL;
         }
+        const unsigned int trials = feedback_loop_trials > 0 ? variants : 1;
+        const bool first_run_of_target_mse = !acolormap && target_mse > 0;
+        const double trial_max_mse = MAX(MAX(45.0/65536.0, target_mse), least_error)*1.2;
 
-        if (feedback_loop_trials <= 0) {
-            return newmap;
+        // variant 0 is the same as a single trial and works on the histogram itself,
+        // so copies for the other variants are taken before any variant starts changing it
+        for(unsigned int t=1; t < trials; t++) {
+            memcpy(&copies[hist->size * (t-1)], hist->achv, sizeof(hist->achv[0]) * hist->size);
         }
 
-        // after palette has been created, total error (MSE) is calculated to keep the best palette
-        // at the same time K-Means iteration is done to improve the palette
-        // and histogram weights are adjusted based on remapping error to give more weight to poorly matched colors
+        // Odd variants reset the target like after a failed trial,
+        // and every other variant moves weights halfway back to perceptual weights once more.
+        #pragma omp parallel for if (trials > 1) \
+            schedule(dynamic, 1) default(shared)
+        for(unsigned int t=0; t < trials; t++) {
+            trial_hist[t] = *hist;
+            trial_overshoot[t] = (t & 1) ? 1.0 : target_mse_overshoot;
+            if (t > 0) {
+                hist_item *const achv = &copies[hist->size * (t-1)];
+                for(unsigned int blend=0; blend < (t+1)/2; blend++) {
+                    for(unsigned int j=0; j < hist->size; j++) {
+                        achv[j].adjusted_weight = (achv[j].perceptual_weight + achv[j].adjusted_weight)/2.0;
+                    }
+                }
+                trial_hist[t].achv = achv;
+            }
 
-        const bool first_run_of_target_mse = !acolormap && target_mse > 0;
-        double total_error = kmeans_do_iteration(hist, newmap, first_run_of_target_mse ? NULL : adjust_histogram_callback);
+            colormap *newmap = NULL;
+            if (hist->size && fixed_colors_count < max_colors) {
+                newmap = mediancut(&trial_hist[t], max_colors-fixed_colors_count, target_mse * trial_overshoot[t], trial_max_mse,
+                                   options->malloc, options->free);
+            }
+            newmap = add_fixed_colors_to_palette(newmap, max_colors, fixed_colors, fixed_colors_count, options->malloc, options->free);
 
-        // goal is to increase quality or to reduce number of colors used if quality is good enough
-        if (!acolormap || total_error < least_error || (total_error <= target_mse && newmap->colors < max_colors)) {
-            if (acolormap) pam_freecolormap(acolormap);
-            acolormap = newmap;
+            // after palette has been created, total error (MSE) is calculated to keep the best palette
+            // at the same time K-Means iteration is done to improve the palette
+            // and histogram weights are adjusted based on remapping error to give more weight to poorly matched colors
+            if (newmap && feedback_loop_trials > 0) {
+                trial_error[t] = kmeans_do_iteration(&trial_hist[t], newmap, first_run_of_target_mse ? NULL : adjust_histogram_callback);
+            }
+            trial_map[t] = newmap;
+        }
 
-            if (total_error < target_mse && total_error > 0) {
-                // K-Means iteration improves quality above what mediancut aims for
-                // this compensates for it, making mediancut aim for worse
-                target_mse_overshoot = MIN(target_mse_overshoot*1.25, target_mse/total_error);
+        for(unsigned int t=0; t < trials; t++) {
+            if (!trial_map[t]) {
+                for(unsigned int i=0; i < trials; i++) {
+                    if (trial_map[i]) pam_freecolormap(trial_map[i]);
+                }
+                if (acolormap) pam_freecolormap(acolormap);
+                if (copies) options->free(copies);
+                return NULL;
             }
+        }
 
-            least_error = total_error;
+        if (feedback_loop_trials <= 0) {
+            if (copies) options->free(copies);
+            return trial_map[0];
+        }
+
+        // variants are judged in order, as if they were consecutive trials
+        int best_trial = -1;
+        double least_trial_error = MAX_DIFF;
+        for(unsigned int t=0; t < trials; t++) {
+            colormap *const newmap = trial_map[t];
+            const double total_error = trial_error[t];
+            least_trial_error = MIN(least_trial_error, total_error);
+
+            // goal is to increase quality or to reduce number of colors used if quality is good enough
+            if (!acolormap || total_error < least_error || (total_error <= target_mse && newmap->colors < max_colors)) {
+                if (acolormap) pam_freecolormap(acolormap);
+                acolormap = newmap;
+
+                if (total_error < target_mse && total_error > 0) {
+                    // K-Means iteration improves quality above what mediancut aims for
+                    // this compensates for it, making mediancut aim for worse
+                    target_mse_overshoot = MIN(trial_overshoot[t]*1.25, target_mse/total_error);
+                }
 
-            // if number of colors could be reduced, try to keep it that way
-            // but allow extra color as a bit of wiggle room in case quality can be improved too
-            max_colors = MIN(newmap->colors+1, max_colors);
+                least_error = total_error;
+
+                // if number of colors could be reduced, try to keep it that way
+                // but allow extra color as a bit of wiggle room in case quality can be improved too
+                max_colors = MIN(newmap->colors+1, max_colors);
+                best_trial = t;
+            } else {
+                pam_freecolormap(newmap);
+            }
+        }
 
-            feedback_loop_trials -= 1; // asymptotic improvement could make it go on forever
+        if (best_trial >= 0) {
+            if (best_trial > 0) {
+                memcpy(hist->achv, trial_hist[best_trial].achv, sizeof(hist->achv[0]) * hist->size);
+            }
+            feedback_loop_trials -= trials; // asymptotic improvement could make it go on forever
         } else {
             for(unsigned int j=0; j < hist->size; j++) {
                 hist->achv[j].adjusted_weight = (hist->achv[j].perceptual_weight + hist->achv[j].adjusted_weight)/2.0;
             }
 
             target_mse_overshoot = 1.0;
-            feedback_loop_trials -= 6;
+            feedback_loop_trials -= 6 + (trials-1);
             // if error is really bad, it's unlikely to improve, so end sooner
-            if (total_error > least_error*4) feedback_loop_trials -= 3;
-            pam_freecolormap(newmap);
+            if (least_trial_error > least_error*4) feedback_loop_trials -= 3;
         }
 
         float fraction_done = 1.f-MAX(0.f, feedback_loop_trials/total_trials);
@@ -1944,10 +2690,18 @@ static colormap *find_best_palette(histogram *hist, const liq_attr *options, con
     }
     while(feedback_loop_trials > 0);
 
+    if (copies) options->free(copies);
     *palette_error_p = least_error;
     return acolormap;
 }
 
+LIQ_NONNULL static bool kmeans_iteration_progress(unsigned int iteration, unsigned int max_iterations, double mse, void *user_info)
+{
+    const liq_attr *options = user_info;
+    liq_verbose_printf(options, "    iteration %u MSE=%.3f", iteration+1, mse_to_standard_mse(mse));
+    return !liq_progress(options, options->progress_stage1 + options->progress_stage2 + (iteration * options->progress_stage3 * 0.9f) / max_iterations);
+}
+
 static colormap *histogram_to_palette(const histogram *hist, const liq_attr *options) {
     if (!hist->size) {
         return NULL;
@@ -2004,26 +2758,7 @@ LIQ_NONNULL static liq_error pngquant_quantize(histogram *hist, const liq_attr *
 
             verbose_print(options, "  moving colormap towards local minimum");
 
-            double previous_palette_error = MAX_DIFF;
-
-            for(unsigned int i=0; i < iterations; i++) {
-                palette_error = kmeans_do_iteration(hist, acolormap, NULL);
-
-                if (liq_progress(options, options->progress_stage1 + options->progress_stage2 + (i * options->progress_stage3 * 0.9f) / iterations)) {
-                    break;
-                }
-
-                if (fabs(previous_palette_error-palette_error) < iteration_limit) {
-                    break;
-                }
-
-                if (palette_error > max_mse*1.5) { // probably hopeless
-                    if (palette_error > max_mse*3.0) break; // definitely hopeless
-                    i++;
-                }
-
-                previous_palette_error = palette_error;
-            }
+            palette_error = kmeans_refine(hist, acolormap, iterations, iteration_limit, max_mse, kmeans_iteration_progress, (void*)options);
         }
 
         if (palette_error > max_mse) {
@@ -2057,6 +2792,7 @@ LIQ_NONNULL static liq_error pngquant_quantize(histogram *hist, const liq_attr *
         .malloc = options->malloc,
         .free = options->free,
         .palette = acolormap,
+        .index_map = color_index_map_create(hist, options->malloc),
         .palette_error = palette_error,
         .use_dither_map = options->use_dither_map,
         .gamma = gamma,
@@ -2121,14 +2857,14 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_write_remapped_image_rows(liq_result *quant
     float remapping_error = result->palette_error;
     if (result->dither_level == 0) {
         set_rounded_palette(&result->int_palette, result->palette, result->gamma, quant->min_posterization_output);
-        remapping_error = remap_to_palette(input_image, row_pointers, result->palette);
+        remapping_error = remap_to_palette(input_image, row_pointers, result->palette, result->palette_error, quant->index_map);
     } else {
         const bool is_image_huge = (input_image->width * input_image->height) > 2000 * 2000;
         const bool allow_dither_map = result->use_dither_map == 2 || (!is_image_huge && result->use_dither_map);
         const bool generate_dither_map = allow_dither_map && (input_image->edges && !input_image->dither_map);
         if (generate_dither_map) {
             // If dithering (with dither map) is required, this image is used to find areas that require dithering
-            remapping_error = remap_to_palette(input_image, row_pointers, result->palette);
+            remapping_error = remap_to_palette(input_image, row_pointers, result->palette, result->palette_error, quant->index_map);
             update_dither_map(input_image, row_pointers, result->palette);
         }
 
@@ -2139,8 +2875,15 @@ LIQ_EXPORT LIQ_NONNULL liq_error liq_write_remapped_image_rows(liq_result *quant
         // remapping above was the last chance to do K-Means iteration, hence the final palette is set after remapping
         set_rounded_palette(&result->int_palette, result->palette, result->gamma, quant->min_posterization_output);
 
-        if (!remap_to_palette_floyd(input_image, row_pointers, result, MAX(remapping_error*2.4, 16.f/256.f), generate_dither_map)) {
-            return LIQ_ABORTED;
+        if (result->dither_mode == LIQ_DITHER_FLOYD_STEINBERG) {
+            if (!remap_to_palette_floyd(input_image, row_pointers, result, MAX(remapping_error*2.4, 16.f/256.f), generate_dither_map)) {
+                return LIQ_ABORTED;
+            }
+        } else {
+            const liq_error err = remap_to_palette_ordered(input_image, row_pointers, result, generate_dither_map);
+            if (err != LIQ_OK) {
+                return err;
+            }
         }
     }
 
@@ -60,6 +60,12 @@ typedef enum liq_error {
     LIQ_UNSUPPORTED,
 } liq_error;
 
+typedef enum liq_dithering_mode {
+    LIQ_DITHER_FLOYD_STEINBERG = 0,
+    LIQ_DITHER_BAYER,
+    LIQ_DITHER_BLUE_NOISE,
+} liq_dithering_mode;
+
 enum liq_ownership {
     LIQ_OWN_ROWS=4,
     LIQ_OWN_PIXELS=8,
@@ -86,6 +92,8 @@ LIQ_EXPORT liq_error liq_set_max_colors(liq_attr* attr, int colors) LIQ_NONNULL;
 LIQ_EXPORT LIQ_USERESULT int liq_get_max_colors(const liq_attr* attr) LIQ_NONNULL;
 LIQ_EXPORT liq_error liq_set_speed(liq_attr* attr, int speed) LIQ_NONNULL;
 LIQ_EXPORT LIQ_USERESULT int liq_get_speed(const liq_attr* attr) LIQ_NONNULL;
+LIQ_EXPORT liq_error liq_set_speculative_trials(liq_attr* attr, int trials) LIQ_NONNULL;
+LIQ_EXPORT LIQ_USERESULT int liq_get_speculative_trials(const liq_attr* attr) LIQ_NONNULL;
 LIQ_EXPORT liq_error liq_set_min_opacity(liq_attr* attr, int min) LIQ_NONNULL;
 LIQ_EXPORT LIQ_USERESULT int liq_get_min_opacity(const liq_attr* attr) LIQ_NONNULL;
 LIQ_EXPORT liq_error liq_set_min_posterization(liq_attr* attr, int bits) LIQ_NONNULL;
@@ -123,6 +131,7 @@ LIQ_EXPORT LIQ_USERESULT liq_error liq_histogram_quantize(liq_histogram *const i
 LIQ_EXPORT LIQ_USERESULT liq_error liq_image_quantize(liq_image *const input_image, liq_attr *const options, liq_result **result_output) LIQ_NONNULL;
 
 LIQ_EXPORT liq_error liq_set_dithering_level(liq_result *res, float dither_level) LIQ_NONNULL;
+LIQ_EXPORT liq_error liq_set_dithering_mode(liq_result *res, liq_dithering_mode mode) LIQ_NONNULL;
 LIQ_EXPORT liq_error liq_set_output_gamma(liq_result* res, double gamma) LIQ_NONNULL;
 LIQ_EXPORT LIQ_USERESULT double liq_get_output_gamma(const liq_result *result) LIQ_NONNULL;
 
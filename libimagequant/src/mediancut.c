@@ -8,13 +8,30 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "libimagequant.h"
 #include "pam.h"
 #include "mediancut.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_num_threads() 1
+#define omp_get_max_threads() 1
+#define omp_in_parallel() 0
+#endif
+
 #define index_of_channel(ch) (offsetof(f_pixel,ch)/sizeof(float))
 
+// boxes with more colors are split into buckets of sort_value before quick select
+#define BUCKET_SORT_MIN_COLORS 512
+#define SORT_BUCKETS 256
+
+// boxes with more colors are split by the whole team, with the parallel loops inside box_split,
+// and smaller ones in tasks, several at a time
+#define TEAM_SPLIT_MIN_COLORS 25000
+
 static f_pixel averagepixels(unsigned int clrs, const hist_item achv[]);
 
 struct box {
@@ -25,6 +42,12 @@ struct box {
     unsigned int colors;
 };
 
+/** Halves of a box split ahead of time, in a copy of the box's part of the histogram */
+struct box_split {
+    struct box lower, upper;
+    bool ready;
+};
+
 ALWAYS_INLINE static double variance_diff(double val, const double good_enough);
 inline static double variance_diff(double val, const double good_enough)
 {
@@ -33,12 +56,41 @@ inline static double variance_diff(double val, const double good_enough)
     return val;
 }
 
+#if USE_SSE
+ALWAYS_INLINE static __m128d variance_diff_sse(__m128d val, const __m128d good_enough_sq);
+inline static __m128d variance_diff_sse(__m128d val, const __m128d good_enough_sq)
+{
+    val = _mm_mul_pd(val, val);
+    const __m128d below = _mm_cmplt_pd(val, good_enough_sq);
+    return _mm_mul_pd(val, _mm_or_pd(_mm_and_pd(below, _mm_set1_pd(0.25)), _mm_andnot_pd(below, _mm_set1_pd(1.0))));
+}
+#endif
+
 /** Weighted per-channel variance of the box. It's used to decide which channel to split by */
 static f_pixel box_variance(const hist_item achv[], const struct box *box)
 {
     f_pixel mean = box->color;
     double variancea=0, variancer=0, varianceg=0, varianceb=0;
 
+#if USE_SSE
+    // same as the loop below, two channels at a time, and with each channel summed in the same order
+    const __m128 vmean = _mm_load_ps((const float*)&mean);
+    const __m128d good_enough_ar = _mm_set_pd((1.0/256.0)*(1.0/256.0), (2.0/256.0)*(2.0/256.0));
+    const __m128d good_enough_gb = _mm_set1_pd((1.0/256.0)*(1.0/256.0));
+    __m128d variancear = _mm_setzero_pd(), variancegb = _mm_setzero_pd();
+
+    for(unsigned int i = 0; i < box->colors; ++i) {
+        const __m128 diff = _mm_sub_ps(vmean, _mm_load_ps((const float*)&achv[box->ind + i].acolor));
+        const __m128d weight = _mm_set1_pd(achv[box->ind + i].adjusted_weight);
+        variancear = _mm_add_pd(variancear, _mm_mul_pd(variance_diff_sse(_mm_cvtps_pd(diff), good_enough_ar), weight));
+        variancegb = _mm_add_pd(variancegb, _mm_mul_pd(variance_diff_sse(_mm_cvtps_pd(_mm_movehl_ps(diff, diff)), good_enough_gb), weight));
+    }
+
+    variancea = _mm_cvtsd_f64(variancear);
+    variancer = _mm_cvtsd_f64(_mm_unpackhi_pd(variancear, variancear));
+    varianceg = _mm_cvtsd_f64(variancegb);
+    varianceb = _mm_cvtsd_f64(_mm_unpackhi_pd(variancegb, variancegb));
+#else
     for(unsigned int i = 0; i < box->colors; ++i) {
         const f_pixel px = achv[box->ind + i].acolor;
         double weight = achv[box->ind + i].adjusted_weight;
@@ -47,6 +99,7 @@ static f_pixel box_variance(const hist_item achv[], const struct box *box)
         varianceg += variance_diff(mean.g - px.g, 1.0/256.0)*weight;
         varianceb += variance_diff(mean.b - px.b, 1.0/256.0)*weight;
     }
+#endif
 
     return (f_pixel){
         .a = variancea*(4.0/16.0),
@@ -166,7 +219,63 @@ static hist_item *hist_item_sort_halfvar(hist_item base[], unsigned int len, dou
     } while(1);
 }
 
-static f_pixel get_median(const struct box *b, hist_item achv[]);
+/*
+ ** Partitions items into buckets of sort_value between min_value and max_value, in descending order like qsort_partition.
+ ** It's one counting pass and one pass moving items through the buffer, and items in each bucket keep their order.
+ ** Bucket k is base[bucket_start[k]] to base[bucket_start[k+1]-1].
+ */
+static void hist_item_bucket_sort(hist_item base[], const unsigned int len, const unsigned int min_value, const unsigned int max_value,
+                                  hist_item buffer[], unsigned int bucket_start[])
+{
+    unsigned int shift = 0;
+    while (((max_value - min_value) >> shift) >= SORT_BUCKETS) shift++;
+
+    unsigned int counts[SORT_BUCKETS] = {0};
+    for(unsigned int i=0; i < len; i++) {
+        counts[(max_value - base[i].tmp.sort_value) >> shift]++;
+    }
+
+    unsigned int offset = 0;
+    for(unsigned int k=0; k < SORT_BUCKETS; k++) {
+        bucket_start[k] = offset;
+        offset += counts[k];
+    }
+    bucket_start[SORT_BUCKETS] = offset;
+
+    if (max_value == min_value) {
+        return;
+    }
+
+    unsigned int next[SORT_BUCKETS];
+    memcpy(next, bucket_start, sizeof(next));
+    for(unsigned int i=0; i < len; i++) {
+        buffer[next[(max_value - base[i].tmp.sort_value) >> shift]++] = base[i];
+    }
+    memcpy(base, buffer, sizeof(base[0]) * len);
+}
+
+/** hist_item_sort_halfvar for bucket sorted items. Only the bucket where the sum of weights crosses halfvar needs to be sorted. */
+static hist_item *hist_item_bucket_halfvar(hist_item base[], const unsigned int bucket_start[], const double halfvar)
+{
+    double lowervar = 0;
+    for(unsigned int k=0; k < SORT_BUCKETS; k++) {
+        const unsigned int start = bucket_start[k], end = bucket_start[k+1];
+        double bucketvar = lowervar;
+        for(unsigned int i=start; i < end; i++) bucketvar += base[i].color_weight;
+
+        // empty buckets are skipped, because sorting reads the first item even if there's none
+        if (end > start && bucketvar > halfvar) {
+            hist_item *res = hist_item_sort_halfvar(&base[start], end - start, &lowervar, halfvar);
+            // sorting sums weights in another order, so rounding may keep it under halfvar,
+            // but the edge is in this bucket anyway
+            return res ? res : &base[end-1];
+        }
+        lowervar = bucketvar;
+    }
+    return &base[bucket_start[SORT_BUCKETS]-1];
+}
+
+static f_pixel get_median(const struct box *b, hist_item achv[], const unsigned int bucket_start[]);
 
 typedef struct {
     unsigned int chan; float variance;
@@ -178,8 +287,11 @@ static int comparevariance(const void *ch1, const void *ch2)
            (((const channelvariance*)ch1)->variance < ((const channelvariance*)ch2)->variance ? 1 : 0);
 }
 
-/** Finds which channels need to be sorted first and preproceses achv for fast sort */
-static double prepare_sort(struct box *b, hist_item achv[])
+/*
+ ** Finds which channels need to be sorted first and preproceses achv for fast sort.
+ ** With a bucket buffer the box is bucket sorted too, and bucket_start is set.
+ */
+static double prepare_sort(const struct box *b, hist_item achv[], hist_item bucket_buffer[], unsigned int bucket_start[])
 {
     /*
      ** Sort dimensions by their variance, and then sort colors first by dimension with highest variance
@@ -195,17 +307,24 @@ static double prepare_sort(struct box *b, hist_item achv[])
 
     const unsigned int ind1 = b->ind;
     const unsigned int colors = b->colors;
+    unsigned int min_value = ~0U, max_value = 0;
     #pragma omp parallel for if (colors > 25000) \
-        schedule(static) default(none) shared(achv, channels)
+        schedule(static) default(shared) reduction(min:min_value) reduction(max:max_value)
     for(unsigned int i=0; i < colors; i++) {
         const float *chans = (const float *)&achv[ind1 + i].acolor;
         // Only the first channel really matters. When trying median cut many times
         // with different histogram weights, I don't want sort randomness to influence outcome.
-        achv[ind1 + i].tmp.sort_value = ((unsigned int)(chans[channels[0].chan]*65535.0)<<16) |
+        const unsigned int sort_value = ((unsigned int)(chans[channels[0].chan]*65535.0)<<16) |
                                         (unsigned int)((chans[channels[2].chan] + chans[channels[1].chan]/2.0 + chans[channels[3].chan]/4.0)*65535.0);
+        achv[ind1 + i].tmp.sort_value = sort_value;
+        min_value = MIN(min_value, sort_value);
+        max_value = MAX(max_value, sort_value);
     }
 
-    const f_pixel median = get_median(b, achv);
+    if (bucket_buffer) {
+        hist_item_bucket_sort(&achv[ind1], colors, min_value, max_value, bucket_buffer, bucket_start);
+    }
+    const f_pixel median = get_median(b, achv, bucket_buffer ? bucket_start : NULL);
 
     // box will be split to make color_weight of each side even
     const unsigned int ind = b->ind, end = ind+b->colors;
@@ -217,12 +336,20 @@ static double prepare_sort(struct box *b, hist_item achv[])
 }
 
 /** finds median in unsorted set by sorting only minimum required */
-static f_pixel get_median(const struct box *b, hist_item achv[])
+static f_pixel get_median(const struct box *b, hist_item achv[], const unsigned int bucket_start[])
 {
     const unsigned int median_start = (b->colors-1)/2;
 
-    hist_item_sort_range(&(achv[b->ind]), b->colors,
-                         median_start);
+    if (bucket_start) {
+        // only the bucket with the median needs sorting
+        unsigned int k = 0;
+        while (bucket_start[k+1] <= median_start) k++;
+        hist_item_sort_range(&(achv[b->ind + bucket_start[k]]), bucket_start[k+1] - bucket_start[k],
+                             median_start - bucket_start[k]);
+    } else {
+        hist_item_sort_range(&(achv[b->ind]), b->colors,
+                             median_start);
+    }
 
     if (b->colors&1) return achv[b->ind + median_start].acolor;
 
@@ -233,12 +360,13 @@ static f_pixel get_median(const struct box *b, hist_item achv[])
 
 /*
  ** Find the best splittable box. -1 if no boxes are splittable.
+ ** If splits are given, boxes that already have a split ready are skipped.
  */
-static int best_splittable_box(struct box bv[], unsigned int boxes, const double max_mse)
+static int best_splittable_box(const struct box bv[], unsigned int boxes, const double max_mse, const struct box_split splits[])
 {
     int bi=-1; double maxsum=0;
     for(unsigned int i=0; i < boxes; i++) {
-        if (bv[i].colors < 2) {
+        if (bv[i].colors < 2 || (splits && splits[i].ready)) {
             continue;
         }
 
@@ -317,6 +445,52 @@ static void box_init(struct box *box, const hist_item *achv, const unsigned int
     box->max_error = box_max_error(achv, box);
 }
 
+/*
+ ** Splits the box in two. Only the box's own range of achv is reordered, so different boxes can be split at the same time.
+ */
+static void box_split(const struct box *b, hist_item achv[], struct box *lower, struct box *upper, void* (*malloc)(size_t), void (*free)(void*))
+{
+    const unsigned int indx = b->ind;
+    const unsigned int clrs = b->colors;
+
+    /*
+     Classic implementation tries to get even number of colors or pixels in each subdivision.
+
+     Here, instead of popularity I use (sqrt(popularity)*variance) metric.
+     Each subdivision balances number of pixels (popular colors) and low variance -
+     boxes can be large if they have similar colors. Later boxes with high variance
+     will be more likely to be split.
+
+     Median used as expected value gives much better results than mean.
+     */
+
+    hist_item *bucket_buffer = clrs >= BUCKET_SORT_MIN_COLORS ? malloc(sizeof(achv[0]) * clrs) : NULL;
+    unsigned int bucket_start[SORT_BUCKETS+1];
+    const double halfvar = prepare_sort(b, achv, bucket_buffer, bucket_start);
+    hist_item *break_p;
+    if (bucket_buffer) {
+        free(bucket_buffer);
+        break_p = hist_item_bucket_halfvar(&achv[indx], bucket_start, halfvar);
+    } else {
+        double lowervar=0;
+
+        // hist_item_sort_halfvar sorts and sums lowervar at the same time
+        // returns item to break at …minus one, which does smell like an off-by-one error.
+        break_p = hist_item_sort_halfvar(&achv[indx], clrs, &lowervar, halfvar);
+    }
+    unsigned int break_at = MIN(clrs-1, break_p - &achv[indx] + 1);
+
+    double sm = b->sum;
+    double lowersum = 0;
+    for(unsigned int i=0; i < break_at; i++) lowersum += achv[indx + i].adjusted_weight;
+
+    #pragma omp taskgroup
+    {
+        box_init(lower, achv, indx, break_at, lowersum);
+        box_init(upper, achv, indx + break_at, clrs - break_at, sm - lowersum);
+    }
+}
+
 /*
  ** Here is the fun part, the median-cut colormap generator.  This is based
  ** on Paul Heckbert's paper, "Color Image Quantization for Frame Buffer
@@ -326,78 +500,111 @@ LIQ_PRIVATE colormap *mediancut(histogram *hist, unsigned int newcolors, const d
 {
     hist_item *achv = hist->achv;
     LIQ_ARRAY(struct box, bv, newcolors);
-    unsigned int boxes = 1;
+    LIQ_ARRAY(struct box_split, splits, newcolors);
+    unsigned int boxes = 1, splits_ahead = 0, max_splits_ahead = 0;
+    hist_item *scratch = NULL;
+    for(unsigned int i=0; i < newcolors; i++) {
+        splits[i].ready = false;
+    }
+
+    // with more threads, boxes are split ahead of time into a scratch copy of the histogram
+    // (there's only one thread if this runs in another parallel region)
+    if (omp_get_max_threads() > 1 && !omp_in_parallel()) {
+        scratch = malloc(sizeof(achv[0]) * hist->size);
+        if (scratch) max_splits_ahead = omp_get_max_threads() - 1;
+    }
 
     /*
      ** Set up the initial box.
      */
-    #pragma omp parallel
-    #pragma omp single
+    double sum = 0;
+    for(unsigned int i=0; i < hist->size; i++) {
+        sum += achv[i].adjusted_weight;
+    }
+    #pragma omp taskgroup
     {
-        double sum = 0;
-        for(unsigned int i=0; i < hist->size; i++) {
-            sum += achv[i].adjusted_weight;
-        }
-        #pragma omp taskgroup
-        {
-            box_init(&bv[0], achv, 0, hist->size, sum);
-        }
-
-
-        /*
-         ** Main loop: split boxes until we have enough.
-         */
-        while (boxes < newcolors) {
-
-            // first splits boxes that exceed quality limit (to have colors for things like odd green pixel),
-            // later raises the limit to allow large smooth areas/gradients get colors.
-            const double current_max_mse = max_mse + (boxes/(double)newcolors)*16.0*max_mse;
-            const int bi = best_splittable_box(bv, boxes, current_max_mse);
-            if (bi < 0) {
-                break;    /* ran out of colors! */
-            }
-
-            unsigned int indx = bv[bi].ind;
-            unsigned int clrs = bv[bi].colors;
-
-            /*
-             Classic implementation tries to get even number of colors or pixels in each subdivision.
-
-             Here, instead of popularity I use (sqrt(popularity)*variance) metric.
-             Each subdivision balances number of pixels (popular colors) and low variance -
-             boxes can be large if they have similar colors. Later boxes with high variance
-             will be more likely to be split.
-
-             Median used as expected value gives much better results than mean.
-             */
-
-            const double halfvar = prepare_sort(&bv[bi], achv);
-            double lowervar=0;
+        box_init(&bv[0], achv, 0, hist->size, sum);
+    }
 
-            // hist_item_sort_halfvar sorts and sums lowervar at the same time
-            // returns item to break at …minus one, which does smell like an off-by-one error.
-            hist_item *break_p = hist_item_sort_halfvar(&achv[indx], clrs, &lowervar, halfvar);
-            unsigned int break_at = MIN(clrs-1, break_p - &achv[indx] + 1);
+    int large_box = -1;
+    do {
+        if (large_box >= 0) {
+            // Done like a split ahead, but outside of the team's region, so that the loops inside use all threads
+            memcpy(&scratch[bv[large_box].ind], &achv[bv[large_box].ind], sizeof(achv[0]) * bv[large_box].colors);
+            box_split(&bv[large_box], scratch, &splits[large_box].lower, &splits[large_box].upper, malloc, free);
+            splits[large_box].ready = true;
+            splits_ahead++;
+            large_box = -1;
+        }
 
+        #pragma omp parallel if (max_splits_ahead > 0)
+        #pragma omp single
+        {
             /*
-             ** Split the box.
+             ** Main loop: split boxes until we have enough.
              */
-            double sm = bv[bi].sum;
-            double lowersum = 0;
-            for(unsigned int i=0; i < break_at; i++) lowersum += achv[indx + i].adjusted_weight;
-
-            #pragma omp taskgroup
-            {
-                box_init(&bv[bi], achv, indx, break_at, lowersum);
-                box_init(&bv[boxes], achv, indx + break_at, clrs - break_at, sm - lowersum);
-            }
-
-            ++boxes;
-
-            if (total_box_error_below_target(target_mse, bv, boxes, hist)) {
-                break;
+            while (boxes < newcolors) {
+
+                // first splits boxes that exceed quality limit (to have colors for things like odd green pixel),
+                // later raises the limit to allow large smooth areas/gradients get colors.
+                const double current_max_mse = max_mse + (boxes/(double)newcolors)*16.0*max_mse;
+                const int bi = best_splittable_box(bv, boxes, current_max_mse, NULL);
+                if (bi < 0) {
+                    break;    /* ran out of colors! */
+                }
+
+                const bool split_ahead = splits[bi].ready;
+                if (!split_ahead && max_splits_ahead > 0 && bv[bi].colors >= TEAM_SPLIT_MIN_COLORS) {
+                    large_box = bi;
+                    break;
+                }
+
+                #pragma omp taskgroup
+                {
+                    if (!split_ahead) {
+                        #pragma omp task
+                        box_split(&bv[bi], achv, &splits[bi].lower, &splits[bi].upper, malloc, free);
+                        splits[bi].ready = true;
+                    }
+
+                    // Meanwhile other threads split boxes likely to be picked next. Until a box is picked its split
+                    // stays in the scratch copy, so the histogram (and the result) is the same as when splitting one by one.
+                    while(splits_ahead < max_splits_ahead) {
+                        const int si = best_splittable_box(bv, boxes, current_max_mse, splits);
+                        if (si < 0 || bv[si].colors >= TEAM_SPLIT_MIN_COLORS) {
+                            break;
+                        }
+                        splits[si].ready = true;
+                        splits_ahead++;
+
+                        #pragma omp task
+                        {
+                            memcpy(&scratch[bv[si].ind], &achv[bv[si].ind], sizeof(achv[0]) * bv[si].colors);
+                            box_split(&bv[si], scratch, &splits[si].lower, &splits[si].upper, malloc, free);
+                        }
+                    }
+                }
+
+                if (split_ahead) {
+                    splits_ahead--;
+                    memcpy(&achv[bv[bi].ind], &scratch[bv[bi].ind], sizeof(achv[0]) * bv[bi].colors);
+                }
+                bv[bi] = splits[bi].lower;
+                bv[boxes] = splits[bi].upper;
+                splits[bi].ready = false;
+                splits[boxes].ready = false;
+
+                ++boxes;
+
+                if (total_box_error_below_target(target_mse, bv, boxes, hist)) {
+                    break;
+                }
             }
         }
+    } while (large_box >= 0);
+
+    if (scratch) {
+        free(scratch);
     }
 
     colormap *map = pam_colormap(boxes, malloc, free);
@@ -34,6 +34,10 @@ struct nearest_map {
     vp_node *root;
     const colormap_item *palette;
     float nearest_other_color_dist[256];
+#ifdef LIQ_SOA_WIDTH
+    f_pixel_soa *soa_palette; // set when the whole palette is scanned instead of walking the tree
+    unsigned int soa_blocks;
+#endif
     mempoolptr mempool;
 };
 
@@ -106,7 +110,94 @@ static vp_node *vp_create_node(mempoolptr *m, vp_sort_tmp indexes[], int num_ind
     return node;
 }
 
-LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map) {
+#ifdef LIQ_SOA_WIDTH
+/*
+ * Cost model choosing between the tree and scanning the whole palette for searches that miss the guess.
+ * The tree visits few nodes when colors searched are close to palette entries (flat images, screenshots),
+ * but in noisy images it goes deep and every node is an unpredictable branch.
+ * A scan costs one SIMD comparison per LIQ_SOA_WIDTH entries, and no branches.
+ * Measured on AVX2 and AVX-512: the scan is as fast or faster for palettes up to 64 colors whatever the image,
+ * and for larger palettes it's faster only when the average error is high (1.4x-2x for photos, 2x slower for screenshots).
+ */
+#define NEAREST_SOA_MAX_COLORS 64
+#define NEAREST_SOA_MIN_ERROR (1.0/256.0)
+
+static bool nearest_use_soa_palette(const colormap *map, const double palette_error)
+{
+    return map->colors <= NEAREST_SOA_MAX_COLORS || palette_error >= NEAREST_SOA_MIN_ERROR;
+}
+
+static void nearest_init_soa_palette(mempoolptr *m, struct nearest_map *handle, const colormap *map)
+{
+    const unsigned int blocks = (map->colors + LIQ_SOA_WIDTH - 1) / LIQ_SOA_WIDTH;
+    f_pixel_soa *const soa_palette = mempool_alloc(m, sizeof(soa_palette[0]) * blocks, sizeof(soa_palette[0]) * blocks);
+    if (!soa_palette) {
+        return;
+    }
+
+    for(unsigned int i=0; i < blocks * LIQ_SOA_WIDTH; i++) {
+        // Padding repeats the first color. Its copies have higher indices, so they never win a tie with it.
+        const f_pixel px = map->palette[i < map->colors ? i : 0].acolor;
+        f_pixel_soa *const block = &soa_palette[i / LIQ_SOA_WIDTH];
+        block->a[i % LIQ_SOA_WIDTH] = px.a;
+        block->r[i % LIQ_SOA_WIDTH] = px.r;
+        block->g[i % LIQ_SOA_WIDTH] = px.g;
+        block->b[i % LIQ_SOA_WIDTH] = px.b;
+    }
+    handle->soa_palette = soa_palette;
+    handle->soa_blocks = blocks;
+}
+
+/**
+ * Finds the nearest color by comparing the pixel with every palette entry, LIQ_SOA_WIDTH at a time.
+ * Each lane keeps its own best entry, starting from the guess, and the lowest index wins ties between lanes.
+ */
+LIQ_SOA_TARGET static unsigned int nearest_search_soa_palette(const struct nearest_map *handle, const f_pixel *px, const unsigned int guess_idx, float *diff)
+{
+#if USE_AVX512
+    __m512 best_diff = _mm512_set1_ps(*diff);
+    __m512i best_idx = _mm512_set1_epi32(guess_idx);
+    __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for(unsigned int i=0; i < handle->soa_blocks; i++) {
+        const __m512 block_diff = colordifference_soa_ps(*px, &handle->soa_palette[i]);
+        const __mmask16 better = _mm512_cmp_ps_mask(block_diff, best_diff, _CMP_LT_OQ);
+        best_diff = _mm512_mask_mov_ps(best_diff, better, block_diff);
+        best_idx = _mm512_mask_mov_epi32(best_idx, better, idx);
+        idx = _mm512_add_epi32(idx, _mm512_set1_epi32(LIQ_SOA_WIDTH));
+    }
+    float lane_diff[LIQ_SOA_WIDTH];
+    unsigned int lane_idx[LIQ_SOA_WIDTH];
+    _mm512_storeu_ps(lane_diff, best_diff);
+    _mm512_storeu_si512(lane_idx, best_idx);
+#else
+    __m256 best_diff = _mm256_set1_ps(*diff);
+    __m256i best_idx = _mm256_set1_epi32(guess_idx);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for(unsigned int i=0; i < handle->soa_blocks; i++) {
+        const __m256 block_diff = colordifference_soa_ps(*px, &handle->soa_palette[i]);
+        const __m256 better = _mm256_cmp_ps(block_diff, best_diff, _CMP_LT_OQ);
+        best_diff = _mm256_blendv_ps(best_diff, block_diff, better);
+        best_idx = _mm256_blendv_epi8(best_idx, idx, _mm256_castps_si256(better));
+        idx = _mm256_add_epi32(idx, _mm256_set1_epi32(LIQ_SOA_WIDTH));
+    }
+    float lane_diff[LIQ_SOA_WIDTH];
+    unsigned int lane_idx[LIQ_SOA_WIDTH];
+    _mm256_storeu_ps(lane_diff, best_diff);
+    _mm256_storeu_si256((__m256i *)lane_idx, best_idx);
+#endif
+
+    unsigned int best = 0;
+    for(unsigned int i=1; i < LIQ_SOA_WIDTH; i++) {
+        if (lane_diff[i] < lane_diff[best] || (lane_diff[i] == lane_diff[best] && lane_idx[i] < lane_idx[best])) {
+            best = i;
+        }
+    }
+    *diff = lane_diff[best];
+    return lane_idx[best];
+}
+#endif
+
+LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map, const double palette_error) {
     mempoolptr m = NULL;
     struct nearest_map *handle = mempool_create(&m, sizeof(handle[0]), sizeof(handle[0]) + sizeof(vp_node)*map->colors+16, map->malloc, map->free);
 
@@ -132,6 +223,13 @@ LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *map) {
         handle->nearest_other_color_dist[i] = best.distance * best.distance / 4.0; // half of squared distance
     }
 
+#ifdef LIQ_SOA_WIDTH
+    if (liq_soa_supported() && nearest_use_soa_palette(map, palette_error)) {
+        nearest_init_soa_palette(&m, handle, map);
+        handle->mempool = m; // the palette may have needed another block
+    }
+#endif
+
     return handle;
 }
 
@@ -177,6 +275,15 @@ LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *handle, const
         return likely_colormap_index;
     }
 
+#ifdef LIQ_SOA_WIDTH
+    if (handle->soa_palette) {
+        float best_diff = guess_diff;
+        const unsigned int idx = nearest_search_soa_palette(handle, px, likely_colormap_index, &best_diff);
+        if (diff) *diff = best_diff;
+        return idx;
+    }
+#endif
+
     vp_search_tmp best_candidate = {
         .distance = sqrtf(guess_diff),
         .idx = likely_colormap_index,
@@ -189,6 +296,11 @@ LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *handle, const
     return best_candidate.idx;
 }
 
+LIQ_PRIVATE float nearest_other_color_diff(const struct nearest_map *handle, const unsigned int palette_index)
+{
+    return handle->nearest_other_color_dist[palette_index] * 4.f;
+}
+
 LIQ_PRIVATE void nearest_free(struct nearest_map *centroids)
 {
     mempool_destroy(centroids->mempool);
@@ -3,6 +3,9 @@
 //  pngquant
 //
 struct nearest_map;
-LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *palette);
+// palette_error is the expected average colordifference of searched colors to the palette, or < 0 if it's not known
+LIQ_PRIVATE struct nearest_map *nearest_init(const colormap *palette, const double palette_error);
 LIQ_PRIVATE unsigned int nearest_search(const struct nearest_map *map, const f_pixel *px, const int palette_index_guess, float *diff);
+// colordifference between the palette entry and its nearest other entry
+LIQ_PRIVATE float nearest_other_color_diff(const struct nearest_map *map, const unsigned int palette_index);
 LIQ_PRIVATE void nearest_free(struct nearest_map *map);
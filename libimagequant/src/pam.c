@@ -12,167 +12,273 @@
 
 #include "libimagequant.h"
 #include "pam.h"
-#include "mempool.h"
 
-LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, const unsigned char *importance_map)
+/* Posterized color keeps ignorebits fewer significant bits of each channel. Posterizing more keeps fewer of the same bits, so it can be done in steps. */
+ALWAYS_INLINE static unsigned int pam_posterize(const unsigned int color, const unsigned int ignorebits)
 {
-    const unsigned int ignorebits = acht->ignorebits;
     const unsigned int channel_mask = 255U>>ignorebits<<ignorebits;
     const unsigned int channel_hmask = (255U>>ignorebits) ^ 0xFFU;
     const unsigned int posterize_mask = channel_mask << 24 | channel_mask << 16 | channel_mask << 8 | channel_mask;
     const unsigned int posterize_high_mask = channel_hmask << 24 | channel_hmask << 16 | channel_hmask << 8 | channel_hmask;
+    return (color & posterize_mask) | ((color & posterize_high_mask) >> (8-ignorebits));
+}
 
-    const unsigned int hash_size = acht->hash_size;
+ALWAYS_INLINE static bool pam_add_pixel_to_hash(struct acolorhash_table *acht, const rgba_pixel pixel, const unsigned char *importance, const unsigned int count, const unsigned int ignorebits)
+{
+    unsigned int boost;
+
+    // RGBA color is casted to long for easier hasing/comparisons
+    union rgba_as_int px = {pixel};
+    if (!px.rgba.a) {
+        // "dirty alpha" has different RGBA values that end up being the same fully transparent color
+        px.l=0;
+
+        boost = 2000;
+    } else {
+        // mask posterizes all 4 channels in one go
+        px.l = pam_posterize(px.l, ignorebits);
+
+        if (importance) {
+            boost = *importance;
+        } else {
+            boost = 255;
+        }
+    }
 
-    /* Go through the entire image, building a hash table of colors. */
-    for(unsigned int row = 0; row < rows; ++row) {
+    return pam_add_to_hash(acht, boost * count, px);
+}
 
-        for(unsigned int col = 0; col < cols; ++col) {
-            unsigned int boost;
+/* Picks which pixel of a run stands for the whole run. Depends only on position in the image, so bands of rows sample the same pixels as the whole image. */
+inline static unsigned int pam_sample_offset(const unsigned int row, const unsigned int col, const unsigned int length)
+{
+    const unsigned int h = (row * 0x9E3779B1u) ^ (col * 0x85EBCA77u);
+    return ((h ^ (h >> 15)) * 0xC2B2AE3Du >> 16) % length;
+}
 
-            // RGBA color is casted to long for easier hasing/comparisons
-            union rgba_as_int px = {pixels[row][col]};
-            unsigned int hash;
-            if (!px.rgba.a) {
-                // "dirty alpha" has different RGBA values that end up being the same fully transparent color
-                px.l=0; hash=0;
+/*
+ * Adds pixels of rows first_row..first_row+rows of an image to the table.
+ * With sample_stride > 1 only one pixel from each run of sample_stride pixels is added, with the weight of the whole run.
+ * The table may end up with more than maxcolors colors, see pam_limitacolorhash(). Fails only if out of memory.
+ */
+LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, unsigned int first_row, unsigned int sample_stride, const unsigned char *importance_map)
+{
+    const unsigned int ignorebits = acht->ignorebits;
 
-                boost = 2000;
-                if (importance_map) {
-                    importance_map++;
+    /* Go through the entire image, building a hash table of colors. */
+    for(unsigned int row = 0; row < rows; ++row) {
+        const unsigned char *const row_importance = importance_map ? &importance_map[row * cols] : NULL;
+
+        if (sample_stride <= 1) {
+            for(unsigned int col = 0; col < cols; ++col) {
+                if (!pam_add_pixel_to_hash(acht, pixels[row][col], row_importance ? &row_importance[col] : NULL, 1, ignorebits)) {
+                    return false;
                 }
-            } else {
-                // mask posterizes all 4 channels in one go
-                px.l = (px.l & posterize_mask) | ((px.l & posterize_high_mask) >> (8-ignorebits));
-                // fancier hashing algorithms didn't improve much
-                hash = px.l % hash_size;
-
-                if (importance_map) {
-                    boost = *importance_map++;
-                } else {
-                    boost = 255;
+            }
+        } else {
+            for(unsigned int start = 0; start < cols; start += sample_stride) {
+                const unsigned int length = MIN(sample_stride, cols - start);
+                const unsigned int col = start + pam_sample_offset(first_row + row, start, length);
+                if (!pam_add_pixel_to_hash(acht, pixels[row][col], row_importance ? &row_importance[col] : NULL, length, ignorebits)) {
+                    return false;
                 }
             }
+        }
+    }
+    acht->cols = cols;
+    acht->rows += rows;
+    return true;
+}
+
+// different for every color
+inline static unsigned int pam_hash(const unsigned int color)
+{
+    return color * 0x9E3779B1u;
+}
+
+inline static unsigned int pam_hash_slot(const unsigned int color, const unsigned int hash_bits)
+{
+    return pam_hash(color) >> (32 - hash_bits);
+}
+
+/*
+ * Robin hood ordering: colors further from their home slot go first, colors with the same home slot are ordered by their hash.
+ * Slots hold colors sorted by hash (apart from colors that wrapped around the end), whatever the size of the table
+ * and the order in which colors were added.
+ */
+inline static bool pam_hash_goes_before(const unsigned int color, const unsigned int dist, const unsigned int other_color, const unsigned int other_dist)
+{
+    return dist > other_dist || (dist == other_dist && pam_hash(color) < pam_hash(other_color));
+}
+
+static void pam_hash_insert(struct acolorhist_arr_item items[], const unsigned int hash_bits, struct acolorhist_arr_item item)
+{
+    const unsigned int mask = (1u << hash_bits) - 1;
+    unsigned int slot = pam_hash_slot(item.color.l, hash_bits), dist = 0;
+    while(items[slot].color.l) {
+        const unsigned int other_dist = (slot - pam_hash_slot(items[slot].color.l, hash_bits)) & mask;
+        if (pam_hash_goes_before(item.color.l, dist, items[slot].color.l, other_dist)) {
+            const struct acolorhist_arr_item tmp = items[slot];
+            items[slot] = item;
+            item = tmp;
+            dist = other_dist;
+        }
+        slot = (slot + 1) & mask;
+        dist++;
+    }
+    items[slot] = item;
+}
+
+static bool pam_hash_grow(struct acolorhash_table *acht)
+{
+    const unsigned int hash_bits = acht->hash_bits + 1;
+    struct acolorhist_arr_item *const items = acht->malloc(sizeof(items[0]) << hash_bits);
+    if (!items) return false;
+    memset(items, 0, sizeof(items[0]) << hash_bits);
+
+    for(unsigned int i=0; i < 1u << acht->hash_bits; ++i) {
+        if (acht->items[i].color.l) {
+            pam_hash_insert(items, hash_bits, acht->items[i]);
+        }
+    }
+    acht->free(acht->items);
+    acht->items = items;
+    acht->hash_bits = hash_bits;
+    return true;
+}
 
-            if (!pam_add_to_hash(acht, hash, boost, px, row, rows)) {
+LIQ_PRIVATE bool pam_add_to_hash(struct acolorhash_table *acht, unsigned int boost, union rgba_as_int px)
+{
+    if (!px.l) {
+        if (!acht->has_transparent) {
+            acht->colors++;
+            acht->has_transparent = true;
+        }
+        acht->transparent.perceptual_weight += boost;
+        return true;
+    }
+
+    struct acolorhist_arr_item *const items = acht->items;
+    const unsigned int hash_bits = acht->hash_bits, mask = (1u << hash_bits) - 1;
+    unsigned int slot = pam_hash_slot(px.l, hash_bits), dist = 0;
+    for(;;) {
+        const unsigned int color = items[slot].color.l;
+        if (color == px.l) {
+            items[slot].perceptual_weight += boost;
+            return true;
+        }
+        // it would have been placed here
+        if (!color || pam_hash_goes_before(px.l, dist, color, (slot - pam_hash_slot(color, hash_bits)) & mask)) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+        dist++;
+    }
+
+    acht->colors++;
+    pam_hash_insert(items, hash_bits, (struct acolorhist_arr_item){
+        .color = px,
+        .perceptual_weight = boost,
+    });
+
+    // keeps probe sequences short
+    if (acht->colors > (3u << hash_bits) / 4) {
+        return pam_hash_grow(acht);
+    }
+    return true;
+}
+
+/*
+ * Adds all colors of another table, posterized as much as colors in either table are. Order of colors in the tables doesn't depend on order of adding,
+ * so merging tables of parts of an image gives the same histogram as adding the whole image to one.
+ */
+LIQ_PRIVATE bool pam_mergeacolorhash(struct acolorhash_table *acht, const struct acolorhash_table *other)
+{
+    if (acht->ignorebits < other->ignorebits && !pam_posterizeacolorhash(acht, other->ignorebits)) {
+        return false;
+    }
+    const unsigned int ignorebits = acht->ignorebits;
+
+    // Colors come in order of their hash. If they didn't all fit below the load limit, they'd pile up into one ever longer run.
+    const unsigned int colors = acht->colors + other->colors;
+    while((3u << acht->hash_bits) / 4 < colors) {
+        if (!pam_hash_grow(acht)) return false;
+    }
+    if (other->has_transparent && !pam_add_to_hash(acht, other->transparent.perceptual_weight, other->transparent.color)) {
+        return false;
+    }
+    for(unsigned int i=0; i < 1u << other->hash_bits; ++i) {
+        if (other->items[i].color.l) {
+            const union rgba_as_int px = {.l = pam_posterize(other->items[i].color.l, ignorebits)};
+            if (!pam_add_to_hash(acht, other->items[i].perceptual_weight, px)) {
                 return false;
             }
         }
+    }
+    acht->cols = other->cols;
+    acht->rows += other->rows;
+    return true;
+}
 
+/*
+ * Posterizes colors already in the table to a higher ignorebits. Colors that become the same are merged,
+ * so the table is the same as if it was made with that ignorebits from the start.
+ */
+LIQ_PRIVATE bool pam_posterizeacolorhash(struct acolorhash_table *acht, unsigned int ignorebits)
+{
+    struct acolorhist_arr_item *const old_items = acht->items;
+    struct acolorhist_arr_item *const items = acht->malloc(sizeof(items[0]) << acht->hash_bits);
+    if (!items) return false;
+    memset(items, 0, sizeof(items[0]) << acht->hash_bits);
+
+    acht->items = items;
+    acht->colors = acht->has_transparent ? 1 : 0;
+    acht->ignorebits = ignorebits;
+    for(unsigned int i=0; i < 1u << acht->hash_bits; ++i) {
+        if (old_items[i].color.l) {
+            // fewer colors than before, so the table won't grow
+            const union rgba_as_int px = {.l = pam_posterize(old_items[i].color.l, ignorebits)};
+            pam_add_to_hash(acht, old_items[i].perceptual_weight, px);
+        }
     }
-    acht->cols = cols;
-    acht->rows += rows;
+    acht->free(old_items);
     return true;
 }
 
-LIQ_PRIVATE bool pam_add_to_hash(struct acolorhash_table *acht, unsigned int hash, unsigned int boost, union rgba_as_int px, unsigned int row, unsigned int rows)
+/*
+ * Posterizes colors until there are no more than maxcolors of them.
+ */
+LIQ_PRIVATE bool pam_limitacolorhash(struct acolorhash_table *acht)
 {
-            /* head of the hash function stores first 2 colors inline (achl->used = 1..2),
-               to reduce number of allocations of achl->other_items.
-             */
-            struct acolorhist_arr_head *achl = &acht->buckets[hash];
-            if (achl->inline1.color.l == px.l && achl->used) {
-                achl->inline1.perceptual_weight += boost;
-                return true;
-            }
-            if (achl->used) {
-                if (achl->used > 1) {
-                    if (achl->inline2.color.l == px.l) {
-                        achl->inline2.perceptual_weight += boost;
-                        return true;
-                    }
-                    // other items are stored as an array (which gets reallocated if needed)
-                    struct acolorhist_arr_item *other_items = achl->other_items;
-                    unsigned int i = 0;
-                    for (; i < achl->used-2; i++) {
-                        if (other_items[i].color.l == px.l) {
-                            other_items[i].perceptual_weight += boost;
-                            return true;
-                        }
-                    }
-
-                    // the array was allocated with spare items
-                    if (i < achl->capacity) {
-                        other_items[i] = (struct acolorhist_arr_item){
-                            .color = px,
-                            .perceptual_weight = boost,
-                        };
-                        achl->used++;
-                        ++acht->colors;
-                        return true;
-                    }
-
-                    if (++acht->colors > acht->maxcolors) {
-                        return false;
-                    }
-
-                    struct acolorhist_arr_item *new_items;
-                    unsigned int capacity;
-                    if (!other_items) { // there was no array previously, alloc "small" array
-                        capacity = 8;
-                        if (acht->freestackp <= 0) {
-                            // estimate how many colors are going to be + headroom
-                            const size_t mempool_size = ((acht->rows + rows-row) * 2 * acht->colors / (acht->rows + row + 1) + 1024) * sizeof(struct acolorhist_arr_item);
-                            new_items = mempool_alloc(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
-                        } else {
-                            // freestack stores previously freed (reallocated) arrays that can be reused
-                            // (all pesimistically assumed to be capacity = 8)
-                            new_items = acht->freestack[--acht->freestackp];
-                        }
-                    } else {
-                        const unsigned int stacksize = sizeof(acht->freestack)/sizeof(acht->freestack[0]);
-
-                        // simply reallocs and copies array to larger capacity
-                        capacity = achl->capacity*2 + 16;
-                        if (acht->freestackp < stacksize-1) {
-                            acht->freestack[acht->freestackp++] = other_items;
-                        }
-                        const size_t mempool_size = ((acht->rows + rows-row) * 2 * acht->colors / (acht->rows + row + 1) + 32*capacity) * sizeof(struct acolorhist_arr_item);
-                        new_items = mempool_alloc(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
-                        if (!new_items) return false;
-                        memcpy(new_items, other_items, sizeof(other_items[0])*achl->capacity);
-                    }
-
-                    achl->other_items = new_items;
-                    achl->capacity = capacity;
-                    new_items[i] = (struct acolorhist_arr_item){
-                        .color = px,
-                        .perceptual_weight = boost,
-                    };
-                    achl->used++;
-                } else {
-                    // these are elses for first checks whether first and second inline-stored colors are used
-                    achl->inline2.color.l = px.l;
-                    achl->inline2.perceptual_weight = boost;
-                    achl->used = 2;
-                    ++acht->colors;
-                }
-            } else {
-                achl->inline1.color.l = px.l;
-                achl->inline1.perceptual_weight = boost;
-                achl->used = 1;
-                ++acht->colors;
-            }
+    // with 7 bits ignored there are only 16 colors left
+    while(acht->colors > acht->maxcolors && acht->ignorebits < 7) {
+        if (!pam_posterizeacolorhash(acht, acht->ignorebits + 1)) {
+            return false;
+        }
+    }
     return true;
 }
 
 LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, void* (*malloc)(size_t), void (*free)(void*))
 {
-    const size_t estimated_colors = MIN(maxcolors, surface/(ignorebits + (surface > 512*512 ? 6 : 5)));
-    const size_t hash_size = estimated_colors < 66000 ? 6673 : (estimated_colors < 200000 ? 12011 : 24019);
+    const size_t estimated_colors = MIN(MIN(maxcolors, 1<<18), surface/(ignorebits + (surface > 512*512 ? 6 : 5)));
+    unsigned int hash_bits = 10;
+    while((3u << hash_bits) / 4 < estimated_colors) hash_bits++;
 
-    mempoolptr m = NULL;
-    const size_t buckets_size = hash_size * sizeof(struct acolorhist_arr_head);
-    const size_t mempool_size = sizeof(struct acolorhash_table) + buckets_size + estimated_colors * sizeof(struct acolorhist_arr_item);
-    struct acolorhash_table *t = mempool_create(&m, sizeof(*t) + buckets_size, mempool_size, malloc, free);
+    struct acolorhash_table *t = malloc(sizeof(*t));
     if (!t) return NULL;
     *t = (struct acolorhash_table){
-        .mempool = m,
-        .hash_size = hash_size,
+        .malloc = malloc,
+        .free = free,
+        .items = malloc(sizeof(t->items[0]) << hash_bits),
+        .hash_bits = hash_bits,
         .maxcolors = maxcolors,
         .ignorebits = ignorebits,
     };
-    memset(t->buckets, 0, buckets_size);
+    if (!t->items) {
+        free(t);
+        return NULL;
+    }
+    memset(t->items, 0, sizeof(t->items[0]) << hash_bits);
     return t;
 }
 
@@ -209,18 +315,18 @@ LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table
     double total_weight = 0;
 
     unsigned int j=0;
-    for(unsigned int i=0; i < acht->hash_size; ++i) {
-        const struct acolorhist_arr_head *const achl = &acht->buckets[i];
-        if (achl->used) {
-            total_weight += pam_add_to_hist(gamma_lut, hist->achv, &j, &achl->inline1, max_perceptual_weight);
-
-            if (achl->used > 1) {
-                total_weight += pam_add_to_hist(gamma_lut, hist->achv, &j, &achl->inline2, max_perceptual_weight);
-
-                for(unsigned int k=0; k < achl->used-2; k++) {
-                    total_weight += pam_add_to_hist(gamma_lut, hist->achv, &j, &achl->other_items[k], max_perceptual_weight);
-                }
-            }
+    if (acht->has_transparent) {
+        total_weight += pam_add_to_hist(gamma_lut, hist->achv, &j, &acht->transparent, max_perceptual_weight);
+    }
+    // colors that wrapped around the end of the table are at its start, and go last to keep all colors sorted by hash
+    const unsigned int size = 1u << acht->hash_bits;
+    unsigned int wrapped = 0;
+    while(acht->items[wrapped].color.l && pam_hash_slot(acht->items[wrapped].color.l, acht->hash_bits) > wrapped) {
+        wrapped++;
+    }
+    for(unsigned int i=wrapped; i < size + wrapped; ++i) {
+        if (acht->items[i & (size-1)].color.l) {
+            total_weight += pam_add_to_hist(gamma_lut, hist->achv, &j, &acht->items[i & (size-1)], max_perceptual_weight);
         }
     }
     hist->size = j;
@@ -236,7 +342,8 @@ LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table
 LIQ_PRIVATE void pam_freeacolorhash(struct acolorhash_table *acht)
 {
     if (acht) {
-        mempool_destroy(acht->mempool);
+        acht->free(acht->items);
+        acht->free(acht);
     }
 }
 
@@ -36,8 +36,28 @@
 #  endif
 #endif
 
+#ifndef USE_AVX2
+#  if USE_SSE && defined(__AVX2__)
+#    define USE_AVX2 1
+#  else
+#    define USE_AVX2 0
+#  endif
+#endif
+
+#ifndef USE_AVX512
+#  if USE_AVX2 && defined(__AVX512F__)
+#    define USE_AVX512 1
+#  else
+#    define USE_AVX512 0
+#  endif
+#endif
+
 #if USE_SSE
 #  include <xmmintrin.h>
+#  include <emmintrin.h>
+#  if USE_AVX2 || defined(__GNUC__)
+#    include <immintrin.h>
+#  endif
 #  ifdef _MSC_VER
 #    include <intrin.h>
 #    define SSE_ALIGN
@@ -91,6 +111,31 @@ typedef struct {
     float a, r, g, b;
 } SSE_ALIGN f_pixel;
 
+/*
+ * LIQ_SOA_TARGET marks functions using f_pixel_soa kernels, and liq_soa_supported() tells if the CPU can run them.
+ * With GCC or clang on x86 the AVX2 kernels are always built and picked at run time, like pngnq's learning kernels.
+ */
+#if USE_AVX512
+#  define LIQ_SOA_WIDTH 16
+#  define LIQ_SOA_TARGET
+#  define liq_soa_supported() true
+#elif USE_AVX2
+#  define LIQ_SOA_WIDTH 8
+#  define LIQ_SOA_TARGET
+#  define liq_soa_supported() true
+#elif USE_SSE && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define LIQ_SOA_WIDTH 8
+#  define LIQ_SOA_TARGET __attribute__((target("avx2")))
+#  define liq_soa_supported() __builtin_cpu_supports("avx2")
+#endif
+
+#ifdef LIQ_SOA_WIDTH
+/* A block of f_pixels stored channel by channel, one SIMD lane per pixel */
+typedef struct {
+    float a[LIQ_SOA_WIDTH], r[LIQ_SOA_WIDTH], g[LIQ_SOA_WIDTH], b[LIQ_SOA_WIDTH];
+} f_pixel_soa;
+#endif
+
 static const float internal_gamma = 0.5499f;
 
 LIQ_PRIVATE void to_f_set_gamma(float gamma_lut[], const double gamma);
@@ -203,6 +248,57 @@ inline static float colordifference(f_pixel px, f_pixel py)
 #endif
 }
 
+#ifdef LIQ_SOA_WIDTH
+#if USE_AVX512
+typedef __m512 f_soa_diff;
+#else
+typedef __m256 f_soa_diff;
+#endif
+
+/**
+ * Same as colordifference(px, py[i]) for every pixel of the block, summed in the same order so that results are bit-identical.
+ */
+ALWAYS_INLINE LIQ_SOA_TARGET static f_soa_diff colordifference_soa_ps(f_pixel px, const f_pixel_soa *py);
+LIQ_SOA_TARGET inline static f_soa_diff colordifference_soa_ps(f_pixel px, const f_pixel_soa *py)
+{
+#if USE_AVX512
+    const __m512 ya = _mm512_loadu_ps(py->a);
+    const __m512 alphas = _mm512_sub_ps(ya, _mm512_set1_ps(px.a)); // y.a - x.a
+
+    const __m512 blackr = _mm512_sub_ps(_mm512_set1_ps(px.r), _mm512_loadu_ps(py->r)); // x - y
+    const __m512 blackg = _mm512_sub_ps(_mm512_set1_ps(px.g), _mm512_loadu_ps(py->g));
+    const __m512 blackb = _mm512_sub_ps(_mm512_set1_ps(px.b), _mm512_loadu_ps(py->b));
+    const __m512 whiter = _mm512_add_ps(blackr, alphas);
+    const __m512 whiteg = _mm512_add_ps(blackg, alphas);
+    const __m512 whiteb = _mm512_add_ps(blackb, alphas);
+
+    const __m512 maxr = _mm512_max_ps(_mm512_mul_ps(whiter, whiter), _mm512_mul_ps(blackr, blackr));
+    const __m512 maxg = _mm512_max_ps(_mm512_mul_ps(whiteg, whiteg), _mm512_mul_ps(blackg, blackg));
+    const __m512 maxb = _mm512_max_ps(_mm512_mul_ps(whiteb, whiteb), _mm512_mul_ps(blackb, blackb));
+
+    // g + (r + b), like the horizontal sum in colordifference()
+    return _mm512_add_ps(maxg, _mm512_add_ps(maxr, maxb));
+#else
+    const __m256 ya = _mm256_loadu_ps(py->a);
+    const __m256 alphas = _mm256_sub_ps(ya, _mm256_set1_ps(px.a)); // y.a - x.a
+
+    const __m256 blackr = _mm256_sub_ps(_mm256_set1_ps(px.r), _mm256_loadu_ps(py->r)); // x - y
+    const __m256 blackg = _mm256_sub_ps(_mm256_set1_ps(px.g), _mm256_loadu_ps(py->g));
+    const __m256 blackb = _mm256_sub_ps(_mm256_set1_ps(px.b), _mm256_loadu_ps(py->b));
+    const __m256 whiter = _mm256_add_ps(blackr, alphas);
+    const __m256 whiteg = _mm256_add_ps(blackg, alphas);
+    const __m256 whiteb = _mm256_add_ps(blackb, alphas);
+
+    const __m256 maxr = _mm256_max_ps(_mm256_mul_ps(whiter, whiter), _mm256_mul_ps(blackr, blackr));
+    const __m256 maxg = _mm256_max_ps(_mm256_mul_ps(whiteg, whiteg), _mm256_mul_ps(blackg, blackg));
+    const __m256 maxb = _mm256_max_ps(_mm256_mul_ps(whiteb, whiteb), _mm256_mul_ps(blackb, blackb));
+
+    // g + (r + b), like the horizontal sum in colordifference()
+    return _mm256_add_ps(maxg, _mm256_add_ps(maxr, maxb));
+#endif
+}
+#endif
+
 /* from pamcmap.h */
 union rgba_as_int {
     rgba_pixel rgba;
@@ -247,26 +343,25 @@ struct acolorhist_arr_item {
     unsigned int perceptual_weight;
 };
 
-struct acolorhist_arr_head {
-    struct acolorhist_arr_item inline1, inline2;
-    unsigned int used, capacity;
-    struct acolorhist_arr_item *other_items;
-};
-
+/* Open addressing (robin hood) table of colors. Order of colors in it depends only on the colors, not on order in which they were added or size of the table. */
 struct acolorhash_table {
-    struct mempool *mempool;
+    void* (*malloc)(size_t);
+    void (*free)(void*);
+    struct acolorhist_arr_item *items; // color 0 marks empty slots
+    struct acolorhist_arr_item transparent; // all fully transparent pixels are color 0, so it's kept separately
+    bool has_transparent;
     unsigned int ignorebits, maxcolors, colors, cols, rows;
-    unsigned int hash_size;
-    unsigned int freestackp;
-    struct acolorhist_arr_item *freestack[512];
-    struct acolorhist_arr_head buckets[];
+    unsigned int hash_bits;
 };
 
 LIQ_PRIVATE void pam_freeacolorhash(struct acolorhash_table *acht);
 LIQ_PRIVATE struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits, void* (*malloc)(size_t), void (*free)(void*));
 LIQ_PRIVATE histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma, void* (*malloc)(size_t), void (*free)(void*));
-LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, const unsigned char *importance_map);
-LIQ_PRIVATE bool pam_add_to_hash(struct acolorhash_table *acht, unsigned int hash, unsigned int boost, union rgba_as_int px, unsigned int row, unsigned int rows);
+LIQ_PRIVATE bool pam_computeacolorhash(struct acolorhash_table *acht, const rgba_pixel *const pixels[], unsigned int cols, unsigned int rows, unsigned int first_row, unsigned int sample_stride, const unsigned char *importance_map);
+LIQ_PRIVATE bool pam_mergeacolorhash(struct acolorhash_table *acht, const struct acolorhash_table *other);
+LIQ_PRIVATE bool pam_posterizeacolorhash(struct acolorhash_table *acht, unsigned int ignorebits);
+LIQ_PRIVATE bool pam_limitacolorhash(struct acolorhash_table *acht);
+LIQ_PRIVATE bool pam_add_to_hash(struct acolorhash_table *acht, unsigned int boost, union rgba_as_int px);
 
 LIQ_PRIVATE void pam_freeacolorhist(histogram *h);
 
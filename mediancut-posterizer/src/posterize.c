@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <getopt.h>
 //#include "png.h"
+#include "posterizer.h"
 
 void optimizeForAverageFilter(
 							  unsigned char pixels[],
@@ -67,11 +68,11 @@ static void pal_init(palette *pal) {
 }
 
 static void interpolate_palette_front(const palette *pal, unsigned int mapping[], const bool dither);
-static void voronoi(const hist_entry histogram[static 256], palette *pal);
-static double palette_error(const hist_entry histogram[static 256], const palette *palette_orig);
+static void voronoi(const posterizer_context *ctx, const hist_entry histogram[static 256], palette *pal);
+static double palette_error(const posterizer_context *ctx, const hist_entry histogram[static 256], const palette *palette_orig);
 static void interpolate_palette_back(const palette *pal, unsigned int mapping[]);
 
-static void posterize(png24_image_shim *img, unsigned int maxlevels, const double maxerror, bool dither, bool verbose);
+static void posterize(const posterizer_context *ctx, png24_image_shim *img, unsigned int maxlevels, const double maxerror, bool dither, bool verbose);
 
 inline static double int_to_linear(unsigned int value)
 {
@@ -85,25 +86,24 @@ inline static unsigned int linear_to_int(const double value)
     return g < 255.0 ? g : 255;
 }
 
-static double image_gamma, gamma_lut[256];
-
-void set_gamma(const double gamma)
+void posterizer_context_init(posterizer_context *ctx, const double gamma, const unsigned int maxLevels, const bool dither)
 {
-    image_gamma = gamma;
-    for(int i=0; i < 256; i++) gamma_lut[i] = pow(int_to_linear(i), gamma);
+    ctx->gamma = gamma;
+    for(int i=0; i < 256; i++) ctx->gamma_lut[i] = pow(int_to_linear(i), gamma);
+    ctx->max_levels = maxLevels;
+    ctx->dither = dither;
 }
 
 // Converts gamma 2.2 to linear unit value. Linear color is required for preserving brightness (esp. when dithering).
-// call set_gamma first
-inline static double gamma_to_linear(unsigned int value)
+inline static double gamma_to_linear(const posterizer_context *ctx, unsigned int value)
 {
-    return gamma_lut[value];
+    return ctx->gamma_lut[value];
 }
 
 // Reverses gamma_to_linear.
-inline static unsigned int linear_to_gamma(const double value)
+inline static unsigned int linear_to_gamma(const posterizer_context *ctx, const double value)
 {
-    return linear_to_int(pow(value, 1.0/image_gamma));
+    return linear_to_int(pow(value, 1.0/ctx->gamma));
 }
 
 // median cut "box" in this implementation is actually a line,
@@ -115,27 +115,27 @@ struct box {
 
 // helper function that gives integer intensity (palette index) from given weights.
 // NB: in this function color is linear 0..1, alpha is 0..255!
-inline static unsigned int index_from_weights(hist_entry weight, hist_entry sum)
+inline static unsigned int index_from_weights(const posterizer_context *ctx, hist_entry weight, hist_entry sum)
 {
-    const double color_gamma = weight.color ? linear_to_gamma(sum.color/weight.color) * weight.color : 0;
+    const double color_gamma = weight.color ? linear_to_gamma(ctx, sum.color/weight.color) * weight.color : 0;
     const double mixed_linear = (color_gamma + sum.alpha) / (BOTH(weight) * 255.0);
     return linear_to_int(mixed_linear);
 }
 
 // average values in a "box" proportionally to frequency of their occurence
 // returns linear value (which is a mix of color and alpha components, so can't be gamma-corrected later)
-static double weighted_avg_linear(const unsigned int start, const unsigned int end, const hist_entry histogram[static 256])
+static double weighted_avg_linear(const posterizer_context *ctx, const unsigned int start, const unsigned int end, const hist_entry histogram[static 256])
 {
     double weight=0,sum=0;
     for(unsigned int val=start; val < end; val++) {
         weight += BOTH(histogram[val]);
-        sum += gamma_to_linear(val)*histogram[val].color + int_to_linear(val)*histogram[val].alpha;
+        sum += gamma_to_linear(ctx, val)*histogram[val].color + int_to_linear(val)*histogram[val].alpha;
     }
     return weight ? sum/weight : 0;
 }
 
 // returns integer index that from weighed average and applies gamma correction proportionally to amount of color
-static unsigned int weighted_avg_int(const unsigned int start, const unsigned int end, const hist_entry histogram[static 256])
+static unsigned int weighted_avg_int(const posterizer_context *ctx, const unsigned int start, const unsigned int end, const hist_entry histogram[static 256])
 {
     hist_entry weight = {0};
     hist_entry sum = {0};
@@ -143,21 +143,21 @@ static unsigned int weighted_avg_int(const unsigned int start, const unsigned in
     for(unsigned int val=start; val < end; val++) {
         weight.color += histogram[val].color;
         weight.alpha += histogram[val].alpha;
-        sum.color += histogram[val].color * gamma_to_linear(val);
+        sum.color += histogram[val].color * gamma_to_linear(ctx, val);
         sum.alpha += histogram[val].alpha * val;
     }
 
-    return index_from_weights(weight, sum);
+    return index_from_weights(ctx, weight, sum);
 }
 
 // variance (AKA second moment) of the box. Measures how much "spread" the values are
-static double variance_in_range(const unsigned int start, const unsigned int end, const hist_entry histogram[static 256])
+static double variance_in_range(const posterizer_context *ctx, const unsigned int start, const unsigned int end, const hist_entry histogram[static 256])
 {
-    const double avg = weighted_avg_linear(start, end, histogram);
+    const double avg = weighted_avg_linear(ctx, start, end, histogram);
 
     double sum=0;
     for(unsigned int val=start; val < end; val++) {
-        const double color_delta = avg-gamma_to_linear(val);
+        const double color_delta = avg-gamma_to_linear(ctx, val);
         const double alpha_delta = avg-int_to_linear(val);
         sum += color_delta*color_delta*histogram[val].color;
         sum += alpha_delta*alpha_delta*histogram[val].alpha;
@@ -165,13 +165,13 @@ static double variance_in_range(const unsigned int start, const unsigned int end
     return sum;
 }
 
-static double variance(const struct box box, const hist_entry histogram[static 256])
+static double variance(const posterizer_context *ctx, const struct box box, const hist_entry histogram[static 256])
 {
-    return variance_in_range(box.start, box.end, histogram);
+    return variance_in_range(ctx, box.start, box.end, histogram);
 }
 
 // Square error. Estimates how well palette "fits" the histogram.
-static double palette_error(const hist_entry histogram[static 256], const palette *pal)
+static double palette_error(const posterizer_context *ctx, const hist_entry histogram[static 256], const palette *pal)
 {
     unsigned int mapping[256];
 
@@ -180,7 +180,7 @@ static double palette_error(const hist_entry histogram[static 256], const palett
 
     double sum=0, px=0;
     for (unsigned int i=0; i < 256; i++) {
-        double color_delta = gamma_to_linear(i)-gamma_to_linear(mapping[i]);
+        double color_delta = gamma_to_linear(ctx, i)-gamma_to_linear(ctx, mapping[i]);
         double alpha_delta = int_to_linear(i)-int_to_linear(mapping[i]);
         sum += color_delta*color_delta*histogram[i].color;
         sum += alpha_delta*alpha_delta*histogram[i].alpha;
@@ -191,12 +191,12 @@ static double palette_error(const hist_entry histogram[static 256], const palett
 
 // converts boxes to palette.
 // palette here is a sparse array where elem[x]=x is taken, elem[x]=0 is free (except x=0)
-static void palette_from_boxes(const struct box boxes[], const int numboxes, const hist_entry histogram[static 256], palette *pal)
+static void palette_from_boxes(const posterizer_context *ctx, const struct box boxes[], const int numboxes, const hist_entry histogram[static 256], palette *pal)
 {
     pal_init(pal);
 
     for(int box=0; box < numboxes; box++) {
-        pal_set(pal, weighted_avg_int(boxes[box].start, boxes[box].end, histogram));
+        pal_set(pal, weighted_avg_int(ctx, boxes[box].start, boxes[box].end, histogram));
     }
     pal_set(pal, 0);
     pal_set(pal, 255);
@@ -205,7 +205,7 @@ static void palette_from_boxes(const struct box boxes[], const int numboxes, con
 /*
  1-dimensional median cut, using variance for "largest" box
 */
-static unsigned int reduce(const unsigned int maxlevels, const double maxerror, const hist_entry histogram[static 256], palette *pal)
+static unsigned int reduce(const posterizer_context *ctx, const unsigned int maxlevels, const double maxerror, const hist_entry histogram[static 256], palette *pal)
 {
     unsigned int numboxes=1;
     struct box boxes[256];
@@ -235,8 +235,8 @@ static unsigned int reduce(const unsigned int maxlevels, const double maxerror,
         unsigned int bestsplit=0;
         double minvariance = INFINITY;
         for(unsigned int val=boxes[boxtosplit].start+1; val < boxes[boxtosplit].end-1; val++) {
-            const double variance = variance_in_range(boxes[boxtosplit].start, val, histogram)
-                                  + variance_in_range(val, boxes[boxtosplit].end, histogram);
+            const double variance = variance_in_range(ctx, boxes[boxtosplit].start, val, histogram)
+                                  + variance_in_range(ctx, val, boxes[boxtosplit].end, histogram);
             if (variance < minvariance) {
                 minvariance = variance;
                 bestsplit = val;
@@ -250,24 +250,24 @@ static unsigned int reduce(const unsigned int maxlevels, const double maxerror,
         boxes[numboxes].start = boxes[boxtosplit].start;
         boxes[numboxes].end = bestsplit;
         boxes[numboxes].sum = sum;
-        boxes[numboxes].variance = variance(boxes[numboxes], histogram);
+        boxes[numboxes].variance = variance(ctx, boxes[numboxes], histogram);
         boxes[boxtosplit].start = bestsplit;
         boxes[boxtosplit].sum -= boxes[numboxes].sum;
-        boxes[boxtosplit].variance = variance(boxes[boxtosplit], histogram);
+        boxes[boxtosplit].variance = variance(ctx, boxes[boxtosplit], histogram);
         numboxes++;
 
         if (maxerror > 0 && maxerror != INFINITY) {
-            palette_from_boxes(boxes, numboxes, histogram, pal);
+            palette_from_boxes(ctx, boxes, numboxes, histogram, pal);
 
-            voronoi(histogram, pal);
+            voronoi(ctx, histogram, pal);
 
-            if (palette_error(histogram, pal) < maxerror) {
+            if (palette_error(ctx, histogram, pal) < maxerror) {
                 return numboxes;
             }
         }
     }
 
-    palette_from_boxes(boxes, numboxes, histogram, pal);
+    palette_from_boxes(ctx, boxes, numboxes, histogram, pal);
 
     return numboxes;
 }
@@ -402,7 +402,7 @@ static void usage(const char *exepath)
 
 // performs voronoi iteration (mapping histogram to palette and creating new palette from remapped values)
 // this shifts palette towards local optimum
-static void voronoi(const hist_entry histogram[static 256], palette *pal)
+static void voronoi(const posterizer_context *ctx, const hist_entry histogram[static 256], palette *pal)
 {
     unsigned int mapping[256];
 
@@ -417,7 +417,7 @@ static void voronoi(const hist_entry histogram[static 256], palette *pal)
         if (0==best || 255==best) continue; // those two are guaranteed to be present, so ignore their influence
         weights[best].color += histogram[val].color;
         weights[best].alpha += histogram[val].alpha;
-        sums[best].color += histogram[val].color * gamma_to_linear(val);
+        sums[best].color += histogram[val].color * gamma_to_linear(ctx, val);
         sums[best].alpha += histogram[val].alpha * val;
     }
 
@@ -426,7 +426,7 @@ static void voronoi(const hist_entry histogram[static 256], palette *pal)
     // rebuild palette from remapped averages
     for(unsigned int i=1; i < 255; i++) {
         if (BOTH(weights[i])) {
-            pal_set(pal, index_from_weights(weights[i], sums[i]));
+            pal_set(pal, index_from_weights(ctx, weights[i], sums[i]));
         }
     }
     pal_set(pal, 0);
@@ -464,7 +464,7 @@ static unsigned int mse_to_quality(double mse)
 
 
 
-static void posterize(png24_image_shim *img, unsigned int maxlevels, const double maxerror, bool dither, bool verbose)
+static void posterize(const posterizer_context *ctx, png24_image_shim *img, unsigned int maxlevels, const double maxerror, bool dither, bool verbose)
 {
     hist_entry histogram[256]={{0}};
     intensity_histogram(img, histogram);
@@ -482,13 +482,13 @@ static void posterize(png24_image_shim *img, unsigned int maxlevels, const doubl
     }
 
     palette pal;
-    unsigned int levels = reduce(maxlevels, maxerror, histogram, &pal);
+    unsigned int levels = reduce(ctx, maxlevels, maxerror, histogram, &pal);
 
     double last_err = INFINITY;
     for(unsigned int j=0; j < 100; j++) {
-        voronoi(histogram, &pal);
+        voronoi(ctx, histogram, &pal);
 
-        double new_err = palette_error(histogram, &pal);
+        double new_err = palette_error(ctx, histogram, &pal);
         if (new_err == last_err) break;
         last_err = new_err;
     }
@@ -500,16 +500,16 @@ static void posterize(png24_image_shim *img, unsigned int maxlevels, const doubl
     remap(img, &pal, dither);
 }
 
-void posterizer(unsigned char * rgbaData, unsigned int w, unsigned int h, unsigned int maxLevels, bool dither){
+void posterizer(const posterizer_context *ctx, unsigned char * rgbaData, unsigned int w, unsigned int h){
 	png24_image_shim img;
 	img.height = h;
 	img.width = w;
 	img.rgba_data = rgbaData;
 	const double maxError = quality_to_mse(0);
-	posterize(&img, maxLevels, maxError, dither, false);
+	posterize(ctx, &img, ctx->max_levels, maxError, ctx->dither, false);
 }
 
-void blurizer(unsigned char * rgbaData, unsigned int w, unsigned int h, unsigned int maxLevels){
-	optimizeForAverageFilter(rgbaData, w, h, 256 - maxLevels);
+void blurizer(const posterizer_context *ctx, unsigned char * rgbaData, unsigned int w, unsigned int h){
+	optimizeForAverageFilter(rgbaData, w, h, 256 - ctx->max_levels);
 }
 
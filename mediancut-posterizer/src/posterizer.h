@@ -15,11 +15,25 @@
 */
 
 
+#ifndef POSTERIZER_H
+#define POSTERIZER_H
+
 #include <stdbool.h>
 
+// Gamma tables and settings, owned by the caller.
+// A context is only read while posterizing, so it can be shared between threads,
+// and threads using different contexts don't interfere with each other.
+typedef struct {
+    double gamma;
+    double gamma_lut[256];
+    unsigned int max_levels;
+    bool dither;
+} posterizer_context;
+
+void posterizer_context_init(posterizer_context *ctx, const double gamma, const unsigned int maxLevels, const bool dither);
 
-void set_gamma(const double gamma);
+void posterizer(const posterizer_context *ctx, unsigned char * rgbaData, unsigned int w, unsigned int h);
 
-void posterizer(unsigned char * rgbaData, unsigned int w, unsigned int h, unsigned int maxLevels, bool dither);
+void blurizer(const posterizer_context *ctx, unsigned char * rgbaData, unsigned int w, unsigned int h);
 
-void blurizer(unsigned char * rgbaData, unsigned int w, unsigned int h, unsigned int maxLevels);
+#endif
@@ -29,13 +29,24 @@
 #include "neuquant32.h"
 #include <math.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NQ_AVX2 1                       /* AVX2 kernels, used when the CPU supports them */
+#include <immintrin.h>
+#else
+#define NQ_AVX2 0
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
 
 /* 
     Network Definitions
 */
    
-#define maxnetpos   (MAXNETSIZE-1)
 #define ncycles     100                 /* no. of learning cycles */
+#define minshardpixels 1024             /* smallest run of samples given to a learning thread */
 #define ABS(a) ((a)>=0?(a):-(a))
 
 /* defs for freq and bias */
@@ -52,7 +63,6 @@
 /* defs for decreasing alpha factor */
 #define alphabiasshift  10              /* alpha starts at 1.0 */
 #define initalpha   ((double)(1<<alphabiasshift))
-double alphadec;                        /* biased by 10 bits */
 
 /* radbias and alpharadbias used for radpower calculation */
 #define radbiasshift    8
@@ -70,6 +80,7 @@ network_data* initnet(unsigned char *thepic,unsigned int len,unsigned int colour
 {
     unsigned int i;
     network_data * networkdata = malloc(sizeof(network_data));
+    if (!networkdata) return NULL;
     networkdata->gamma_correction = gamma_c;
     
     /* Clear out network from previous runs */
@@ -79,6 +90,7 @@ network_data* initnet(unsigned char *thepic,unsigned int len,unsigned int colour
     networkdata->thepicture = thepic;
     networkdata->lengthcount = len;
     networkdata->netsize = colours;
+    networkdata->double_precision = 1;
     
     for(i=0;i<256;i++)
     {
@@ -122,7 +134,7 @@ static inline unsigned int round_biased(double temp)
 }
 
 
-inline static double biasvalue(network_data * networkdata, unsigned int temp)
+inline static double biasvalue(const network_data * networkdata, unsigned int temp)
 {    
     return networkdata->biasvalues[temp];
 }
@@ -140,6 +152,11 @@ void getcolormap(network_data * networkdata, unsigned char *map)
     }
 }
 
+inline static double colorimportance(double al)
+{
+    double transparency = 1.0 - al/255.0;
+    return (1.0 - transparency * transparency);
+}
 
 /* Insertion sort of network and building of netindex[0..255] (to do after unbias)
    ------------------------------------------------------------------------------- */
@@ -150,6 +167,8 @@ void inxbuild(network_data * networkdata)
 {
     unsigned int i,j,smallpos,smallval;
     unsigned int previouscol,startpos;
+    /* last neuron in use: colormap entries past it are never written */
+    const unsigned int maxnetpos = networkdata->netsize-1;
 
     for(i=0; i< networkdata->netsize; i++)
     {
@@ -186,15 +205,19 @@ void inxbuild(network_data * networkdata)
     }
     networkdata->netindex[previouscol] = (startpos+maxnetpos)>>1;
     for (j=previouscol+1; j<256; j++) networkdata->netindex[j] = maxnetpos; /* really 256 */
+    
+    for (i=0; i<256; i++) networkdata->colimportance[i] = colorimportance(i);
 }
 
-        
-inline static double colorimportance(double al)
+void inxcache_init(nq_inxcache *cache)
 {
-    double transparency = 1.0 - al/255.0;
-    return (1.0 - transparency * transparency);
+    unsigned int i;
+    for (i=0; i<(1<<INXCACHEBITS); i++) cache->index[i] = -1;
+    cache->lastkey = 0;
+    cache->lastindex = -1;
 }
 
+
 /* Search for ABGR values 0..255 (after net is unbiased) and return colour index
    ---------------------------------------------------------------------------- */
 
@@ -228,7 +251,7 @@ unsigned int slowinxsearch(network_data * networkdata,  int al, int b, int g, in
     return best;
 }
 
-unsigned int inxsearch( network_data * networkdata, int al, int b, int g, int r)
+unsigned int inxsearch(const network_data * networkdata, int al, int b, int g, int r)
 {
     unsigned int i; int j; double dist,a,bestd;
     unsigned int best;
@@ -251,7 +274,7 @@ unsigned int inxsearch( network_data * networkdata, int al, int b, int g, int r)
     j = i-1;        /* start at netindex[g] and work outwards */
 
 
-    double colimp = colorimportance(al);
+    double colimp = networkdata->colimportance[al];
 
     while ((i<networkdata->netsize) || (j>=0)) {
         if (i<networkdata->netsize) {
@@ -302,7 +325,7 @@ unsigned int inxsearch( network_data * networkdata, int al, int b, int g, int r)
 /* Search for biased ABGR values
    ---------------------------- */
 
-int contest(network_data * networkdata, double al,double b,double g,double r)
+static int contest(network_data * networkdata, double al,double b,double g,double r)
 {
     /* finds closest neuron (min dist) and updates freq */
     /* finds best neuron (min dist-bias) and returns position */
@@ -352,9 +375,10 @@ int contest(network_data * networkdata, double al,double b,double g,double r)
 
 
 /* Move neuron i towards biased (a,b,g,r) by factor alpha
-   ---------------------------------------------------- */
+   ----------------------------------------------------
+   retain, when not NULL, accumulates the factor each neuron was scaled by (see learnshard_merge) */
 
-static void altersingle(network_data * networkdata, double alpha,unsigned int i,double al,double b,double g,double r)
+static void altersingle(network_data * networkdata, double alpha,unsigned int i,double al,double b,double g,double r,double *retain)
 {    
     double colorimp = 1.0;//0.5;// + 0.7*colorimportance(al);
     
@@ -365,13 +389,14 @@ static void altersingle(network_data * networkdata, double alpha,unsigned int i,
     networkdata->network[i].b -= colorimp*alpha*(networkdata->network[i].b - b);
     networkdata->network[i].g -= colorimp*alpha*(networkdata->network[i].g - g);
     networkdata->network[i].r -= colorimp*alpha*(networkdata->network[i].r - r);
+    if (retain) retain[i] *= 1.0 - alpha;
 }
 
 
 /* Move adjacent neurons by precomputed alpha*(1-((i-j)^2/[r]^2)) in radpower[|i-j|]
    --------------------------------------------------------------------------------- */
 
-static void alterneigh(network_data * networkdata, unsigned int rad,unsigned int i,double al,double b,double g,double r)
+static void alterneigh(network_data * networkdata, unsigned int rad,unsigned int i,double al,double b,double g,double r,double *retain)
 {
     unsigned int j,hi;
     int k,lo;
@@ -390,6 +415,7 @@ static void alterneigh(network_data * networkdata, unsigned int rad,unsigned int
             networkdata->network[j].b  -= a*(networkdata->network[j].b  - b) ;
             networkdata->network[j].g  -= a*(networkdata->network[j].g  - g) ;
             networkdata->network[j].r  -= a*(networkdata->network[j].r  - r) ;
+            if (retain) retain[j] *= 1.0 - a;
             j++;
         }
         if (k>lo) {
@@ -397,36 +423,503 @@ static void alterneigh(network_data * networkdata, unsigned int rad,unsigned int
             networkdata->network[k].b  -= a*(networkdata->network[k].b  - b) ;
             networkdata->network[k].g  -= a*(networkdata->network[k].g  - g) ;
             networkdata->network[k].r  -= a*(networkdata->network[k].r  - r) ;
+            if (retain) retain[k] *= 1.0 - a;
             k--;
         }
     }
 }
 
 
+/* Single Precision Learning
+   -------------------------
+   The same contest, altersingle and alterneigh steps on the float network. The SIMD
+   versions do the operations of the scalar ones in the same order on 4 (SSE2) or
+   8 (AVX2) neurons at a time, and ties still go to the lowest neuron. */
+
+typedef struct {
+    unsigned int (*contest)(nq_fnetwork *fn, unsigned int netsize, float al, float b, float g, float r);
+    void (*alter)(nq_fnetwork *fn, unsigned int netsize, unsigned int i, unsigned int rad, float al, float b, float g, float r);
+} nq_kernels;
+
+static void fnetwork_load(network_data * networkdata)
+{
+    nq_fnetwork *fn = &networkdata->fnetwork;
+    unsigned int i;
+    for (i=0; i<MAXNETSIZE; i++) {
+        if (i < networkdata->netsize) {
+            fn->al[i] = networkdata->network[i].al;
+            fn->b[i]  = networkdata->network[i].b;
+            fn->g[i]  = networkdata->network[i].g;
+            fn->r[i]  = networkdata->network[i].r;
+            fn->bias[i] = networkdata->bias[i];
+            fn->freq[i] = networkdata->freq[i];
+        } else {
+            fn->al[i] = fn->b[i] = fn->g[i] = fn->r[i] = 1e30f;
+            fn->bias[i] = fn->freq[i] = 0;
+        }
+    }
+}
+
+static void fnetwork_store(network_data * networkdata)
+{
+    const nq_fnetwork *fn = &networkdata->fnetwork;
+    unsigned int i;
+    for (i=0; i<networkdata->netsize; i++) {
+        networkdata->network[i].al = fn->al[i];
+        networkdata->network[i].b  = fn->b[i];
+        networkdata->network[i].g  = fn->g[i];
+        networkdata->network[i].r  = fn->r[i];
+        networkdata->bias[i] = fn->bias[i];
+        networkdata->freq[i] = fn->freq[i];
+    }
+}
+
+/* Neurons [start, end) are moved when i wins: i itself and the ones alterneigh reaches */
+static inline void alterrange(unsigned int i, unsigned int rad, unsigned int netsize, unsigned int *start, unsigned int *end)
+{
+    if (!rad) {
+        *start = i;
+        *end = i+1;
+        return;
+    }
+    *start = i > rad ? i-rad+1 : (i ? 1 : 0);
+    *end = i+rad < netsize ? i+rad : netsize;
+}
+
+static inline void alterone(nq_fnetwork *fn, unsigned int k, float a, float al, float b, float g, float r)
+{
+    fn->al[k] -= a*(fn->al[k] - al);
+    fn->b[k]  -= a*(fn->b[k]  - b);
+    fn->g[k]  -= a*(fn->g[k]  - g);
+    fn->r[k]  -= a*(fn->r[k]  - r);
+}
+
+/* Lane with the smallest distance, the lowest position on ties */
+static inline unsigned int bestlane(const float *dist, const float *pos, unsigned int lanes)
+{
+    unsigned int l, best = 0;
+    for (l=1; l<lanes; l++) {
+        if (dist[l] < dist[best] || (dist[l] == dist[best] && pos[l] < pos[best])) best = l;
+    }
+    return pos[best];
+}
+
+#if !defined(__SSE2__)
+static void alter_float(nq_fnetwork *fn, unsigned int netsize, unsigned int i, unsigned int rad, float al, float b, float g, float r)
+{
+    unsigned int k,start,end;
+    alterrange(i, rad, netsize, &start, &end);
+    for (k=start; k<end; k++) alterone(fn, k, fn->radweight[initrad + k - i], al, b, g, r);
+}
+
+static unsigned int contest_float(nq_fnetwork *fn, unsigned int netsize, float al, float b, float g, float r)
+{
+    unsigned int i, bestpos = 0, bestbiaspos = 0;
+    float dist, biasdist, betafreq, bestd = 1<<30, bestbiasd = 1<<30;
+    
+    for (i=0; i<netsize; i++) {
+        dist = fabsf(fn->b[i] - b);
+        dist += fabsf(fn->r[i] - r);
+        dist += fabsf(fn->g[i] - g);
+        dist += fabsf(fn->al[i] - al);
+        biasdist = dist - fn->bias[i];
+        if (dist < bestd) {bestd = dist; bestpos = i;}
+        if (biasdist < bestbiasd) {bestbiasd = biasdist; bestbiaspos = i;}
+        betafreq = fn->freq[i] * (float)beta;
+        fn->freq[i] -= betafreq;
+        fn->bias[i] += betafreq * (float)gamma;
+    }
+    fn->freq[bestpos] += (float)beta;
+    fn->bias[bestpos] -= (float)betagamma;
+    return bestbiaspos;
+}
+
+static const nq_kernels floatkernels = { contest_float, alter_float };
+#endif
+
+#if defined(__SSE2__)
+static unsigned int contest_sse2(nq_fnetwork *fn, unsigned int netsize, float al, float b, float g, float r)
+{
+    const __m128 vb = _mm_set1_ps(b), vg = _mm_set1_ps(g), vr = _mm_set1_ps(r), val = _mm_set1_ps(al);
+    const __m128 sign = _mm_set1_ps(-0.0f), vbeta = _mm_set1_ps((float)beta), vgamma = _mm_set1_ps((float)gamma);
+    __m128 bestd = _mm_set1_ps(1<<30), bestbiasd = bestd;
+    __m128 bestpos = _mm_setzero_ps(), bestbiaspos = bestpos;
+    __m128 pos = _mm_setr_ps(0, 1, 2, 3);
+    float d[4] __attribute__((aligned(16))), p[4] __attribute__((aligned(16)));
+    unsigned int i, best;
+    
+    /* Neurons past netsize (up to MAXNETSIZE) are harmless padding */
+    for (i=0; i<netsize; i+=4) {
+        __m128 dist = _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(fn->b + i), vb));
+        dist = _mm_add_ps(dist, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(fn->r + i), vr)));
+        dist = _mm_add_ps(dist, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(fn->g + i), vg)));
+        dist = _mm_add_ps(dist, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(fn->al + i), val)));
+        const __m128 bias = _mm_loadu_ps(fn->bias + i);
+        const __m128 biasdist = _mm_sub_ps(dist, bias);
+        
+        const __m128 closer = _mm_cmplt_ps(dist, bestd);
+        bestd = _mm_or_ps(_mm_and_ps(closer, dist), _mm_andnot_ps(closer, bestd));
+        bestpos = _mm_or_ps(_mm_and_ps(closer, pos), _mm_andnot_ps(closer, bestpos));
+        const __m128 closerbias = _mm_cmplt_ps(biasdist, bestbiasd);
+        bestbiasd = _mm_or_ps(_mm_and_ps(closerbias, biasdist), _mm_andnot_ps(closerbias, bestbiasd));
+        bestbiaspos = _mm_or_ps(_mm_and_ps(closerbias, pos), _mm_andnot_ps(closerbias, bestbiaspos));
+        
+        const __m128 freq = _mm_loadu_ps(fn->freq + i);
+        const __m128 betafreq = _mm_mul_ps(freq, vbeta);
+        _mm_storeu_ps(fn->freq + i, _mm_sub_ps(freq, betafreq));
+        _mm_storeu_ps(fn->bias + i, _mm_add_ps(bias, _mm_mul_ps(betafreq, vgamma)));
+        pos = _mm_add_ps(pos, _mm_set1_ps(4));
+    }
+    
+    _mm_store_ps(d, bestd);
+    _mm_store_ps(p, bestpos);
+    best = bestlane(d, p, 4);
+    fn->freq[best] += (float)beta;
+    fn->bias[best] -= (float)betagamma;
+    _mm_store_ps(d, bestbiasd);
+    _mm_store_ps(p, bestbiaspos);
+    return bestlane(d, p, 4);
+}
+
+static void alter_sse2(nq_fnetwork *fn, unsigned int netsize, unsigned int i, unsigned int rad, float al, float b, float g, float r)
+{
+    const __m128 vb = _mm_set1_ps(b), vg = _mm_set1_ps(g), vr = _mm_set1_ps(r), val = _mm_set1_ps(al);
+    unsigned int k,start,end;
+    alterrange(i, rad, netsize, &start, &end);
+    for (k=start; k+4<=end; k+=4) {
+        const __m128 a = _mm_loadu_ps(fn->radweight + initrad + k - i);
+        __m128 n;
+        n = _mm_loadu_ps(fn->al + k); _mm_storeu_ps(fn->al + k, _mm_sub_ps(n, _mm_mul_ps(a, _mm_sub_ps(n, val))));
+        n = _mm_loadu_ps(fn->b + k);  _mm_storeu_ps(fn->b + k,  _mm_sub_ps(n, _mm_mul_ps(a, _mm_sub_ps(n, vb))));
+        n = _mm_loadu_ps(fn->g + k);  _mm_storeu_ps(fn->g + k,  _mm_sub_ps(n, _mm_mul_ps(a, _mm_sub_ps(n, vg))));
+        n = _mm_loadu_ps(fn->r + k);  _mm_storeu_ps(fn->r + k,  _mm_sub_ps(n, _mm_mul_ps(a, _mm_sub_ps(n, vr))));
+    }
+    for (; k<end; k++) alterone(fn, k, fn->radweight[initrad + k - i], al, b, g, r);
+}
+
+static const nq_kernels sse2kernels = { contest_sse2, alter_sse2 };
+#endif
+
+#if NQ_AVX2
+__attribute__((target("avx2")))
+static unsigned int contest_avx2(nq_fnetwork *fn, unsigned int netsize, float al, float b, float g, float r)
+{
+    const __m256 vb = _mm256_set1_ps(b), vg = _mm256_set1_ps(g), vr = _mm256_set1_ps(r), val = _mm256_set1_ps(al);
+    const __m256 sign = _mm256_set1_ps(-0.0f), vbeta = _mm256_set1_ps((float)beta), vgamma = _mm256_set1_ps((float)gamma);
+    __m256 bestd = _mm256_set1_ps(1<<30), bestbiasd = bestd;
+    __m256 bestpos = _mm256_setzero_ps(), bestbiaspos = bestpos;
+    __m256 pos = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    float d[8] __attribute__((aligned(32))), p[8] __attribute__((aligned(32)));
+    unsigned int i, best;
+    
+    for (i=0; i<netsize; i+=8) {
+        __m256 dist = _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(fn->b + i), vb));
+        dist = _mm256_add_ps(dist, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(fn->r + i), vr)));
+        dist = _mm256_add_ps(dist, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(fn->g + i), vg)));
+        dist = _mm256_add_ps(dist, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(fn->al + i), val)));
+        const __m256 bias = _mm256_loadu_ps(fn->bias + i);
+        const __m256 biasdist = _mm256_sub_ps(dist, bias);
+        
+        const __m256 closer = _mm256_cmp_ps(dist, bestd, _CMP_LT_OQ);
+        bestd = _mm256_blendv_ps(bestd, dist, closer);
+        bestpos = _mm256_blendv_ps(bestpos, pos, closer);
+        const __m256 closerbias = _mm256_cmp_ps(biasdist, bestbiasd, _CMP_LT_OQ);
+        bestbiasd = _mm256_blendv_ps(bestbiasd, biasdist, closerbias);
+        bestbiaspos = _mm256_blendv_ps(bestbiaspos, pos, closerbias);
+        
+        const __m256 freq = _mm256_loadu_ps(fn->freq + i);
+        const __m256 betafreq = _mm256_mul_ps(freq, vbeta);
+        _mm256_storeu_ps(fn->freq + i, _mm256_sub_ps(freq, betafreq));
+        _mm256_storeu_ps(fn->bias + i, _mm256_add_ps(bias, _mm256_mul_ps(betafreq, vgamma)));
+        pos = _mm256_add_ps(pos, _mm256_set1_ps(8));
+    }
+    
+    _mm256_store_ps(d, bestd);
+    _mm256_store_ps(p, bestpos);
+    best = bestlane(d, p, 8);
+    fn->freq[best] += (float)beta;
+    fn->bias[best] -= (float)betagamma;
+    _mm256_store_ps(d, bestbiasd);
+    _mm256_store_ps(p, bestbiaspos);
+    return bestlane(d, p, 8);
+}
+
+__attribute__((target("avx2")))
+static void alter_avx2(nq_fnetwork *fn, unsigned int netsize, unsigned int i, unsigned int rad, float al, float b, float g, float r)
+{
+    const __m256 vb = _mm256_set1_ps(b), vg = _mm256_set1_ps(g), vr = _mm256_set1_ps(r), val = _mm256_set1_ps(al);
+    unsigned int k,start,end;
+    alterrange(i, rad, netsize, &start, &end);
+    for (k=start; k+8<=end; k+=8) {
+        const __m256 a = _mm256_loadu_ps(fn->radweight + initrad + k - i);
+        __m256 n;
+        n = _mm256_loadu_ps(fn->al + k); _mm256_storeu_ps(fn->al + k, _mm256_sub_ps(n, _mm256_mul_ps(a, _mm256_sub_ps(n, val))));
+        n = _mm256_loadu_ps(fn->b + k);  _mm256_storeu_ps(fn->b + k,  _mm256_sub_ps(n, _mm256_mul_ps(a, _mm256_sub_ps(n, vb))));
+        n = _mm256_loadu_ps(fn->g + k);  _mm256_storeu_ps(fn->g + k,  _mm256_sub_ps(n, _mm256_mul_ps(a, _mm256_sub_ps(n, vg))));
+        n = _mm256_loadu_ps(fn->r + k);  _mm256_storeu_ps(fn->r + k,  _mm256_sub_ps(n, _mm256_mul_ps(a, _mm256_sub_ps(n, vr))));
+    }
+    for (; k<end; k++) alterone(fn, k, fn->radweight[initrad + k - i], al, b, g, r);
+}
+
+static const nq_kernels avx2kernels = { contest_avx2, alter_avx2 };
+#endif
+
+/* Kernels for the float network, or NULL to learn on the double one */
+static const nq_kernels *learnkernels(const network_data * networkdata)
+{
+    if (networkdata->double_precision) return NULL;
+#if NQ_AVX2
+    if (__builtin_cpu_supports("avx2")) return &avx2kernels;
+#endif
+#if defined(__SSE2__)
+    return &sse2kernels;
+#else
+    return &floatkernels;
+#endif
+}
+
+
+/* Precompute the neighbourhood weights for the current alpha and radius */
+static void setradpower(network_data * networkdata, double alpha, unsigned int rad)
+{
+    unsigned int j;
+    for (j=0; j<rad; j++) 
+        networkdata->radpower[j] = floor( alpha*(((rad*rad - j*j)*radbias)/(rad*rad)) );
+    
+    /* The same as factors by offset from the winner, for the float network */
+    for (j=1; j<=initrad; j++)
+        networkdata->fnetwork.radweight[initrad+j] = networkdata->fnetwork.radweight[initrad-j] = j < rad ? networkdata->radpower[j] / alpharadbias : 0.0;
+    networkdata->fnetwork.radweight[initrad] = alpha / initalpha;
+}
+
+/* Present one RGBA pixel to the network */
+static inline void learnpixel(network_data * networkdata, const nq_kernels *kernels, const unsigned char *p, double alpha, unsigned int rad, double *retain)
+{
+    unsigned int j,al,b,g,r;
+    if (p[3])
+    {            
+        al =p[3];
+        b = biasvalue(networkdata, p[2]);
+        g = biasvalue(networkdata, p[1]);
+        r = biasvalue(networkdata, p[0]);
+    }
+    else
+    {
+        al=r=g=b=0;
+    }
+    
+    if (kernels) {
+        nq_fnetwork *fn = &networkdata->fnetwork;
+        unsigned int k,start,end;
+        j = kernels->contest(fn, networkdata->netsize, al,b,g,r);
+        kernels->alter(fn, networkdata->netsize, j, rad, al,b,g,r);
+        if (retain) {
+            alterrange(j, rad, networkdata->netsize, &start, &end);
+            for (k=start; k<end; k++) retain[k] *= 1.0 - fn->radweight[initrad + k - j];
+        }
+        return;
+    }
+    
+    j = contest(networkdata, al,b,g,r);
+
+    altersingle(networkdata, alpha,j,al,b,g,r,retain);
+    if (rad) alterneigh(networkdata, rad,j,al,b,g,r,retain);   /* alter neighbours */
+}
+
+
+/* Parallel Learning
+   -----------------
+   Each learning cycle (same alpha and radius) is split in contiguous runs of the
+   prime-stride sample sequence, one per thread. Every thread trains a private copy
+   of the network on its run, then the copies are merged back into the shared network
+   before alpha and radius decrease. */
+
+typedef struct {
+    network_data *net;                  /* private copy trained by this thread */
+    const nq_kernels *kernels;
+    unsigned int first;                 /* index of the first sample in the whole sequence */
+    unsigned int count;
+    unsigned int step;
+    double alpha;
+    unsigned int rad;
+    double retain[MAXNETSIZE];          /* product of the (1-alpha) factors applied to each neuron */
+    pthread_t thread;
+} learnshard;
+
+static void *learnshard_run(void *arg)
+{
+    learnshard *shard = arg;
+    network_data *networkdata = shard->net;
+    unsigned char *pic = networkdata->thepicture;
+    unsigned int len = networkdata->lengthcount;
+    unsigned int pos = (unsigned int)(((unsigned long long)shard->first * shard->step) % len);
+    unsigned int i;
+
+    for (i=0; i<networkdata->netsize; i++) shard->retain[i] = 1.0;
+    for (i=0; i<shard->count; i++) {
+        learnpixel(networkdata, shard->kernels, pic + pos, shard->alpha, shard->rad, shard->retain);
+        pos += shard->step;
+        while (pos >= len) pos -= len;
+    }
+    return NULL;
+}
+
+/* Apply the map value -> retain*value + (copy - retain*start) of one shard */
+static inline double chainshard(double value, double start, double copy, double retain)
+{
+    return retain*value + (copy - retain*start);
+}
+
+/* Every update of a neuron is n -= a*(n - x), so a whole shard maps n to retain*n + d,
+   and the freq decay and hits map freq to (1-beta)^count*freq + e. Chaining these maps
+   shard after shard gives the serial result, up to the winners chosen on a stale network. */
+static void learnshard_merge(network_data * networkdata, const learnshard *shards, unsigned int count)
+{
+    nq_fnetwork *fn = &networkdata->fnetwork;
+    unsigned int i,t;
+    for (i=0; i<networkdata->netsize; i++) {
+        double startfreq, freq;
+        if (shards[0].kernels) {
+            const nq_pixel start = {fn->al[i], fn->b[i], fn->g[i], fn->r[i]};
+            nq_pixel n = start;
+            startfreq = freq = fn->freq[i];
+            for (t=0; t<count; t++) {
+                const nq_fnetwork *copy = &shards[t].net->fnetwork;
+                const double c = shards[t].retain[i];
+                n.al = chainshard(n.al, start.al, copy->al[i], c);
+                n.b  = chainshard(n.b,  start.b,  copy->b[i],  c);
+                n.g  = chainshard(n.g,  start.g,  copy->g[i],  c);
+                n.r  = chainshard(n.r,  start.r,  copy->r[i],  c);
+                freq = chainshard(freq, startfreq, copy->freq[i], pow(1.0 - beta, shards[t].count));
+            }
+            fn->al[i] = n.al;
+            fn->b[i]  = n.b;
+            fn->g[i]  = n.g;
+            fn->r[i]  = n.r;
+            /* contest keeps bias + gamma*freq constant */
+            fn->bias[i] += (startfreq - freq) * gamma;
+            fn->freq[i] = freq;
+        } else {
+            const nq_pixel start = networkdata->network[i];
+            nq_pixel n = start;
+            startfreq = freq = networkdata->freq[i];
+            for (t=0; t<count; t++) {
+                const network_data *copy = shards[t].net;
+                const double c = shards[t].retain[i];
+                n.al = chainshard(n.al, start.al, copy->network[i].al, c);
+                n.b  = chainshard(n.b,  start.b,  copy->network[i].b,  c);
+                n.g  = chainshard(n.g,  start.g,  copy->network[i].g,  c);
+                n.r  = chainshard(n.r,  start.r,  copy->network[i].r,  c);
+                freq = chainshard(freq, startfreq, copy->freq[i], pow(1.0 - beta, shards[t].count));
+            }
+            networkdata->network[i] = n;
+            networkdata->bias[i] += (startfreq - freq) * gamma;
+            networkdata->freq[i] = freq;
+        }
+    }
+}
+
+static int learnparallel(network_data * networkdata, const nq_kernels *kernels, unsigned int threads, unsigned int samplepixels,
+                         unsigned int delta, unsigned int step, double alpha, double radius, unsigned int rad)
+{
+    unsigned int i,t,count,started;
+    learnshard *shards = malloc(threads * sizeof(learnshard));
+    network_data *copies = malloc(threads * sizeof(network_data));
+    if (!shards || !copies) {
+        free(shards);
+        free(copies);
+        return 0;
+    }
+    
+    i = 0;
+    while (i < samplepixels)
+    {
+        count = samplepixels - i;
+        if (count > delta) count = delta;
+        
+        for (t=0; t<threads; t++) {
+            memcpy(&copies[t], networkdata, sizeof(network_data));
+            shards[t].net = &copies[t];
+            shards[t].kernels = kernels;
+            shards[t].first = i + (unsigned int)((unsigned long long)count * t / threads);
+            shards[t].count = i + (unsigned int)((unsigned long long)count * (t+1) / threads) - shards[t].first;
+            shards[t].step = step;
+            shards[t].alpha = alpha;
+            shards[t].rad = rad;
+        }
+        /* The first shard runs on this thread, and the others wherever a thread is available */
+        for (started=1; started<threads; started++) {
+            if (pthread_create(&shards[started].thread, NULL, learnshard_run, &shards[started]) != 0) break;
+        }
+        for (t=started; t<threads; t++) learnshard_run(&shards[t]);
+        learnshard_run(&shards[0]);
+        for (t=1; t<started; t++) pthread_join(shards[t].thread, NULL);
+        
+        learnshard_merge(networkdata, shards, threads);
+        
+        i += count;
+        if (count == delta) {
+            alpha -= alpha / (double)networkdata->alphadec;
+            radius -= radius / (double)radiusdec;
+            rad = radius;
+            if (rad <= 1) rad = 0;
+            setradpower(networkdata, alpha, rad);
+        }
+    }
+    
+    free(copies);
+    free(shards);
+    return 1;
+}
+
+static void learnserial(network_data * networkdata, const nq_kernels *kernels, unsigned int samplepixels,
+                        unsigned int delta, unsigned int step, double alpha, double radius, unsigned int rad, unsigned int verbose)
+{
+    unsigned int i;
+    unsigned char *p = networkdata->thepicture;
+    unsigned char *lim = networkdata->thepicture + networkdata->lengthcount;
+    
+    i = 0;
+    while (i < samplepixels) 
+    {
+        learnpixel(networkdata, kernels, p, alpha, rad, NULL);
+
+        p += step;
+        while (p >= lim) p -= networkdata->lengthcount;
+    
+        i++;
+        if (i%delta == 0) {                    /* FPE here if delta=0*/ 
+            alpha -= alpha / (double)networkdata->alphadec;
+            radius -= radius / (double)radiusdec;
+            rad = radius;
+            if (rad <= 1) rad = 0;
+            setradpower(networkdata, alpha, rad);
+        }
+    }
+    if(verbose) fprintf(stderr,"finished 1D learning: final alpha=%f !\n",((float)alpha)/initalpha);
+}
+
+
 /* Main Learning Loop
    ------------------ */
-/* sampling factor 1..30 */
-void learn(network_data * networkdata, unsigned int samplefac, unsigned int verbose) /* Stu: N.B. added parameter so that main() could control verbosity. */
+/* sampling factor 1..30, threads > 1 enables the parallel learner */
+void learn(network_data * networkdata, unsigned int samplefac, unsigned int threads, unsigned int verbose) /* Stu: N.B. added parameter so that main() could control verbosity. */
 {
-    unsigned int i,j,al,b,g,r;
     unsigned int rad,step,delta,samplepixels;
     double radius,alpha;
-    unsigned char *p;
-    unsigned char *lim;
+    const nq_kernels *kernels = learnkernels(networkdata);
     
-    alphadec = 30 + ((samplefac-1)/3);
-    p = networkdata->thepicture;
-    lim = networkdata->thepicture + networkdata->lengthcount;
+    networkdata->alphadec = 30 + ((samplefac-1)/3);
     samplepixels = networkdata->lengthcount/(4*samplefac);
     delta = samplepixels/ncycles;  /* here's a problem with small images: samplepixels < ncycles => delta = 0 */
     if(delta==0) delta = 1;        /* kludge to fix */
     alpha = initalpha;
     radius = initradius;
     
+    if (kernels) fnetwork_load(networkdata);
     rad = radius;
     if (rad <= 1) rad = 0;
-    for (i=0; i<rad; i++) 
-        networkdata->radpower[i] = floor( alpha*(((rad*rad - i*i)*radbias)/(rad*rad)) );
+    setradpower(networkdata, alpha, rad);
     
     if(verbose) fprintf(stderr,"beginning 1D learning: initial radius=%d\n", rad);
 
@@ -439,37 +932,12 @@ void learn(network_data * networkdata, unsigned int samplefac, unsigned int verb
         }
     }
     
-    i = 0;
-    while (i < samplepixels) 
-    {
-        if (p[3])
-        {            
-            al =p[3];
-            b = biasvalue(networkdata, p[2]);
-            g = biasvalue(networkdata, p[1]);
-            r = biasvalue(networkdata, p[0]);
-        }
-        else
-        {
-            al=r=g=b=0;
-        }
-        j = contest(networkdata, al,b,g,r);
-
-        altersingle(networkdata, alpha,j,al,b,g,r);
-        if (rad) alterneigh(networkdata, rad,j,al,b,g,r);   /* alter neighbours */
-
-        p += step;
-        while (p >= lim) p -= networkdata->lengthcount;
-    
-        i++;
-        if (i%delta == 0) {                    /* FPE here if delta=0*/ 
-            alpha -= alpha / (double)alphadec;
-            radius -= radius / (double)radiusdec;
-            rad = radius;
-            if (rad <= 1) rad = 0;
-            for (j=0; j<rad; j++) 
-               networkdata-> radpower[j] = floor( alpha*(((rad*rad - j*j)*radbias)/(rad*rad)) );
-        }
+    /* Shards smaller than this would mostly measure the merge and thread overhead */
+    if (threads > delta/minshardpixels) threads = delta/minshardpixels;
+    if (threads > 1 && learnparallel(networkdata, kernels, threads, samplepixels, delta, step, alpha, radius, rad)) {
+        if(verbose) fprintf(stderr,"finished 1D learning on %d threads\n", threads);
+    } else {
+        learnserial(networkdata, kernels, samplepixels, delta, step, alpha, radius, rad, verbose);
     }
-    if(verbose) fprintf(stderr,"finished 1D learning: final alpha=%f !\n",((float)alpha)/initalpha);
+    if (kernels) fnetwork_store(networkdata);
 }
@@ -63,6 +63,19 @@ typedef struct
 
 
 #define initrad     (MAXNETSIZE>>3)     /* for 256 cols, radius starts */
+
+/* Single precision copy of the network used while learning, one array per channel
+   so that the SIMD kernels can process several neurons at once.
+   Neurons past netsize are kept far away from any color so they never win. */
+typedef struct
+{
+	float al[MAXNETSIZE], b[MAXNETSIZE], g[MAXNETSIZE], r[MAXNETSIZE];
+	float bias[MAXNETSIZE], freq[MAXNETSIZE];
+	float radweight[2*initrad+1];    /* update factor by offset from the winner (at initrad) */
+} nq_fnetwork;
+
+/* All the state of one quantization lives here (there are no globals),
+   so separate networks can be used from different threads at the same time. */
 typedef struct  {
 	nq_pixel network[MAXNETSIZE];    /* the network itself */
 	
@@ -71,6 +84,9 @@ typedef struct  {
 	double bias [MAXNETSIZE];        /* bias and freq arrays for learning */
 	double freq [MAXNETSIZE];
 	double radpower[initrad];        /* radpower for precomputation */
+	double alphadec;                 /* alpha decrease factor for learning */
+	nq_fnetwork fnetwork;            /* float network for learning */
+	unsigned int double_precision;   /* learn on the double network (reference, set by initnet) instead of the float one */
 	
 	unsigned int netsize;            /* Number of colours to use. */
 	
@@ -80,6 +96,7 @@ typedef struct  {
 	unsigned char *thepicture;      /* the input image itself */
 	unsigned int lengthcount;        /* lengthcount = H*W*4 */
 	nq_colormap colormap[256];
+	double colimportance[256];       /* colour importance of each alpha for inxsearch, set by inxbuild */
 } network_data;
 
 /* Initialise network in range (0,0,0,0) to (255,255,255,255) and set parameters
@@ -88,7 +105,7 @@ network_data * initnet(unsigned char *thepic, unsigned int len, unsigned int col
 		
 /* Unbias network to give byte values 0..255 and record position i to prepare for sort
    ----------------------------------------------------------------------------------- */
-static inline double biasvalue(network_data * networkdata, unsigned int temp);
+static inline double biasvalue(const network_data * networkdata, unsigned int temp);
 
 /* Output colour map
    ----------------- */
@@ -99,13 +116,50 @@ void getcolormap(network_data * networkdata, unsigned char *map);
 void inxbuild(network_data * networkdata);
 
 /* Search for ABGR values 0..255 (after net is unbiased) and return colour index
-   ---------------------------------------------------------------------------- */
-unsigned int inxsearch(network_data * networkdata,  int al,  int b,  int g,  int r);
+   ----------------------------------------------------------------------------
+   Only reads the network, so several threads can search the same one. */
+unsigned int inxsearch(const network_data * networkdata,  int al,  int b,  int g,  int r);
 unsigned int slowinxsearch(network_data * networkdata,  int al, int b, int g, int r);
 
+/* Cache of inxsearch results for remapping, direct-mapped on the packed pixel
+   --------------------------------------------------------------------------- */
+#define INXCACHEBITS 12
+
+typedef struct {
+	unsigned int key[1<<INXCACHEBITS];   /* packed RGBA */
+	int index[1<<INXCACHEBITS];          /* -1 for empty entries */
+	unsigned int lastkey;                /* runs of identical pixels skip the lookup */
+	int lastindex;
+} nq_inxcache;
+
+void inxcache_init(nq_inxcache *cache);
+
+/* Same result as inxsearch */
+static inline unsigned int inxcachesearch(const network_data * networkdata, nq_inxcache *cache, int al, int b, int g, int r)
+{
+	/* inxsearch ignores the colour of transparent pixels */
+	const unsigned int key = al ? (unsigned int)r | (unsigned int)g << 8 | (unsigned int)b << 16 | (unsigned int)al << 24 : 0;
+	unsigned int h;
+	if (key == cache->lastkey && cache->lastindex >= 0) return cache->lastindex;
+	h = (key * 2654435761u) >> (32 - INXCACHEBITS);
+	if (cache->key[h] != key || cache->index[h] < 0) {
+		cache->key[h] = key;
+		cache->index[h] = inxsearch(networkdata, al, b, g, r);
+	}
+	cache->lastkey = key;
+	cache->lastindex = cache->index[h];
+	return cache->lastindex;
+}
+
 /* Main Learning Loop
-   ------------------ */
-void learn(network_data * networkdata, unsigned int samplefactor, unsigned int verbose);
+   ------------------
+   With threads > 1, each learning cycle is split between that many threads training
+   copies of the network, merged at the end of the cycle. Results differ slightly from
+   the serial learner (threads = 0 or 1), which stays the reference.
+   Learning uses the double network by default. Clearing double_precision after initnet
+   learns on the float network with SIMD kernels instead: several times faster, but palettes
+   differ a little from the reference (better or worse MSE depending on the image). */
+void learn(network_data * networkdata, unsigned int samplefactor, unsigned int threads, unsigned int verbose);
 
 /* Program Skeleton
    ----------------
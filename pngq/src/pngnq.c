@@ -72,11 +72,15 @@ extended with \"-nq8.png\"\n"
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h> /* isprint() and features.h */
+#include <pthread.h>
 
 
 #include "neuquant32.h"
 #include "errors.h"
 
+#define MAXREMAPTHREADS 64
+#define MINREMAPROWS 16
+
 typedef unsigned char uch;
 typedef unsigned long ulg;
 
@@ -113,108 +117,172 @@ typedef struct {
 
 
 
- void remap_floyd(network_data * networkdata, unsigned char * rgba_data, unsigned int cols, unsigned int rows, unsigned char * map, unsigned int* remap,  unsigned char * indexed_data, int quantization_method)
+/* Floyd-Steinberg dithering, with the error limiting of pngnq.
+   The error spread to the next row is accumulated in 1/16 units in a row buffer
+   instead of being written back into rgba_data, and alpha-dependent colour
+   importance comes from a table in 1/256 units. Per channel, that leaves two
+   truncating divisions: "/ 16" when a pixel reads the error from the previous row,
+   and "/ 256" when the importance is applied to its own error
+   (plus the error halving, which rarely loops). */
+ int remap_floyd(network_data * networkdata, const unsigned char * rgba_data, unsigned int cols, unsigned int rows, const unsigned char * map, const unsigned int* remap,  unsigned char * indexed_data, int quantization_method)
 {
-	// uch *outrow = NULL; /* Output image pixels */
-	
-	int i,row;
+	int i,row,a;
+	int colorimp[256];
+	nq_inxcache cache;
+	inxcache_init(&cache);
 #define CLAMP(a) ((a)>=0 ? ((a)<=255 ? (a) : 255)  : 0)
 	
+	/* 255 - (255-alpha)^2/255, in 1/256 units */
+	for (a = 0; a < 256; ++a) {
+		colorimp[a] = ((255*255 - (255-a)*(255-a)) * 256 + 255*127) / (255*255);
+	}
+	
+	/* Error to subtract from the current and next rows, 4 channels per pixel with one pixel of margin on each side. */
+	int * errbuffer = calloc((size_t)(cols+2)*4*2, sizeof(int));
+	if (!errbuffer) {
+		return 0;
+	}
+	int * thiserrrow = errbuffer + 4;
+	int * nexterrrow = errbuffer + (cols+2)*4 + 4;
+	
 	/* Do each image row */
 	for ( row = 0; (ulg)row < rows; ++row ) {
-		int offset, nextoffset;
-		
+		const unsigned char * pixels = rgba_data + (size_t)row*cols*4;
 		
 		int rederr=0;
 		int blueerr=0;
 		int greenerr=0;
 		int alphaerr=0;
 		
-		offset = row*cols*4;
-		nextoffset = offset; if (row+1<rows) nextoffset += cols*4;
-		int increment = 4;
+		/* Serpentine scanning goes right to left on odd rows. */
+		const int reverse = quantization_method == 2 && (row & 1);
+		const int increment = reverse ? -1 : 1;
+		i = reverse ? (int)cols-1 : 0;
 		
-		for( i=0;i<cols;i++, offset+=increment, nextoffset+=increment)
+		for(unsigned int n = 0; n < cols; ++n, i += increment)
 		{
 			int idx;
-			unsigned int floyderr = rederr*rederr + greenerr*greenerr + blueerr*blueerr + alphaerr*alphaerr;
+			int * thiserr = thiserrrow + 4*i;
+			int * nexterr = nexterrrow + 4*i;
 			
-			idx = inxsearch(networkdata, CLAMP(rgba_data[offset+3] - alphaerr),
-							CLAMP(rgba_data[offset+2] - blueerr),
-							CLAMP(rgba_data[offset+1] - greenerr),
-							CLAMP(rgba_data[offset]   - rederr  ));
+			/* Source pixel with the error coming from the previous row. */
+			const int red   = CLAMP(pixels[4*i]   - thiserr[0] / 16);
+			const int green = CLAMP(pixels[4*i+1] - thiserr[1] / 16);
+			const int blue  = CLAMP(pixels[4*i+2] - thiserr[2] / 16);
+			const int alpha = CLAMP(pixels[4*i+3] - thiserr[3] / 16);
 			
-			indexed_data[row*cols + (increment > 0 ? i : cols-i-1)] = remap[idx];
+			idx = inxcachesearch(networkdata, &cache, CLAMP(alpha - alphaerr),
+								 CLAMP(blue - blueerr),
+								 CLAMP(green - greenerr),
+								 CLAMP(red - rederr));
 			
-			int alpha = (map[idx*4+3] > rgba_data[offset+3]) ? map[idx*4+3] : rgba_data[offset+3];
-			int colorimp = 255 - ((255-alpha) * (255-alpha) / 255);
+			indexed_data[(size_t)row*cols + i] = remap[idx];
 			
-			int thisrederr=(map[idx*4+0] -   rgba_data[offset]) * colorimp   / 255;
-			int thisblueerr=(map[idx*4+1] - rgba_data[offset+1]) * colorimp  / 255;
-			int thisgreenerr=(map[idx*4+2] -  rgba_data[offset+2]) * colorimp  / 255;
-			int thisalphaerr=map[idx*4+3] - rgba_data[offset+3];
+			const int imp = colorimp[(map[idx*4+3] > alpha) ? map[idx*4+3] : alpha];
+			
+			const int thisrederr = ((map[idx*4+0] - red) * imp) / 256;
+			const int thisgreenerr = ((map[idx*4+1] - green) * imp) / 256;
+			const int thisblueerr = ((map[idx*4+2] - blue) * imp) / 256;
+			const int thisalphaerr = map[idx*4+3] - alpha;
 			
 			rederr += thisrederr;
-			greenerr += thisblueerr;
-			blueerr +=  thisgreenerr;
+			greenerr += thisgreenerr;
+			blueerr += thisblueerr;
 			alphaerr += thisalphaerr;
 			
-			unsigned int thiserr = (thisrederr*thisrederr + thisblueerr*thisblueerr + thisgreenerr*thisgreenerr + thisalphaerr*thisalphaerr)*2;
-			floyderr = rederr*rederr + greenerr*greenerr + blueerr*blueerr + alphaerr*alphaerr;
+			unsigned int thiserrsum = (thisrederr*thisrederr + thisblueerr*thisblueerr + thisgreenerr*thisgreenerr + thisalphaerr*thisalphaerr)*2;
+			unsigned int floyderr = rederr*rederr + greenerr*greenerr + blueerr*blueerr + alphaerr*alphaerr;
 			
-			int L = 10;
+			const int L = 10;
 			while (rederr*rederr > L*L || greenerr*greenerr > L*L || blueerr*blueerr > L*L || alphaerr*alphaerr > L*L ||
-				   floyderr > thiserr || floyderr > L*L*2)
+				   floyderr > thiserrsum || floyderr > L*L*2)
 			{
 				rederr /=2;greenerr /=2;blueerr /=2;alphaerr /=2;
 				floyderr = rederr*rederr + greenerr*greenerr + blueerr*blueerr + alphaerr*alphaerr;
 			}
 			
-			if (i>0)
-			{
-				rgba_data[nextoffset-increment+3]=CLAMP(rgba_data[nextoffset-increment+3] - alphaerr*3/16);
-				rgba_data[nextoffset-increment+2]=CLAMP(rgba_data[nextoffset-increment+2] - blueerr*3/16 );
-				rgba_data[nextoffset-increment+1]=CLAMP(rgba_data[nextoffset-increment+1] - greenerr*3/16);
-				rgba_data[nextoffset-increment]  =CLAMP(rgba_data[nextoffset-increment]   - rederr*3/16  );
-			}
-			if (i+1<cols)
-			{
-				rgba_data[nextoffset+increment+3]=CLAMP(rgba_data[nextoffset+increment+3] - alphaerr/16);
-				rgba_data[nextoffset+increment+2]=CLAMP(rgba_data[nextoffset+increment+2] - blueerr/16 );
-				rgba_data[nextoffset+increment+1]=CLAMP(rgba_data[nextoffset+increment+1] - greenerr/16);
-				rgba_data[nextoffset+increment]  =CLAMP(rgba_data[nextoffset+increment]   - rederr/16  );
-			}
-			rgba_data[nextoffset+3]=CLAMP(rgba_data[nextoffset+3] - alphaerr*5/16);
-			rgba_data[nextoffset+2]=CLAMP(rgba_data[nextoffset+2] - blueerr*5/16 );
-			rgba_data[nextoffset+1]=CLAMP(rgba_data[nextoffset+1] - greenerr*5/16);
-			rgba_data[nextoffset]  =CLAMP(rgba_data[nextoffset]   - rederr*5/16  );
+			/* 3/16 behind, 5/16 below and 1/16 ahead on the next row (margins absorb the edges). */
+			int * behind = nexterr - 4*increment;
+			int * ahead = nexterr + 4*increment;
+			behind[0] += rederr*3;   nexterr[0] += rederr*5;   ahead[0] += rederr;
+			behind[1] += greenerr*3; nexterr[1] += greenerr*5; ahead[1] += greenerr;
+			behind[2] += blueerr*3;  nexterr[2] += blueerr*5;  ahead[2] += blueerr;
+			behind[3] += alphaerr*3; nexterr[3] += alphaerr*5; ahead[3] += alphaerr;
 		}
 		
-		rederr = rederr*7/16; greenerr =greenerr*7/16; blueerr =blueerr*7/16; alphaerr =alphaerr*7/16;
-		
+		/* The next row becomes the current one, and the old current row is cleared for reuse. */
+		int * swap = thiserrrow;
+		thiserrrow = nexterrrow;
+		nexterrrow = swap;
+		memset(nexterrrow - 4, 0, (size_t)(cols+2)*4*sizeof(int));
 	}
 	
+	free(errbuffer);
+	return 1;
 }
 
- void remap_simple(network_data * networkdata, unsigned char * rgba_data, unsigned int cols, unsigned int rows, unsigned int* remap, unsigned char * indexed_data)
+typedef struct {
+	const network_data * networkdata;
+	unsigned char * rgba_data;
+	unsigned int cols, firstrow, lastrow;
+	unsigned int* remap;
+	unsigned char * indexed_data;
+	pthread_t thread;
+} remap_band;
+
+static void * remap_simple_band(void * arg)
 {
+	remap_band * band = arg;
 	unsigned int i,row;
 	unsigned int offset;
+	const unsigned int cols = band->cols;
+	const unsigned char * rgba_data = band->rgba_data;
+	/* Images often repeat colours, and inxsearch is exact for a given pixel */
+	nq_inxcache cache;
+	inxcache_init(&cache);
 	/* Do each image row */
-	for ( row = 0; (ulg)row < rows; ++row )
+	for ( row = band->firstrow; row < band->lastrow; ++row )
 	{
 		/* Assign the new colors */
 		offset = row*cols*4;
 		for( i=0;i<cols;i++){
-			indexed_data[row*cols+i] = remap[inxsearch(networkdata, rgba_data[i*4+offset+3],
-													   rgba_data[i*4+offset+2],
-													   rgba_data[i*4+offset+1],
-													   rgba_data[i*4+offset])];
+			band->indexed_data[row*cols+i] = band->remap[inxcachesearch(band->networkdata, &cache, rgba_data[i*4+offset+3],
+																		rgba_data[i*4+offset+2],
+																		rgba_data[i*4+offset+1],
+																		rgba_data[i*4+offset])];
 		}
-		
 	}
+	return NULL;
+}
+
+/* Each pixel is independent and inxsearch only reads the network,
+   so bands of rows are remapped by separate threads. */
+ void remap_simple(network_data * networkdata, unsigned char * rgba_data, unsigned int cols, unsigned int rows, unsigned int* remap, unsigned char * indexed_data, unsigned int threads)
+{
+	unsigned int t, started;
+	remap_band bands[MAXREMAPTHREADS];
 	
+	/* Bands smaller than this are not worth a thread */
+	if (threads > rows / MINREMAPROWS) threads = rows / MINREMAPROWS;
+	if (threads > MAXREMAPTHREADS) threads = MAXREMAPTHREADS;
+	if (threads < 1) threads = 1;
 	
+	for (t = 0; t < threads; ++t) {
+		bands[t].networkdata = networkdata;
+		bands[t].rgba_data = rgba_data;
+		bands[t].cols = cols;
+		bands[t].firstrow = (unsigned int)((unsigned long long)rows * t / threads);
+		bands[t].lastrow = (unsigned int)((unsigned long long)rows * (t+1) / threads);
+		bands[t].remap = remap;
+		bands[t].indexed_data = indexed_data;
+	}
+	/* The first band runs on this thread, and the others wherever a thread is available */
+	for (started = 1; started < threads; ++started) {
+		if (pthread_create(&bands[started].thread, NULL, remap_simple_band, &bands[started]) != 0) break;
+	}
+	for (t = started; t < threads; ++t) remap_simple_band(&bands[t]);
+	remap_simple_band(&bands[0]);
+	for (t = 1; t < started; ++t) pthread_join(bands[t].thread, NULL);
 }
 
 //
@@ -47,6 +47,10 @@
 #include <stdio.h>
 
 
-void remap_floyd(network_data * networkdata, unsigned char * rgba_data, unsigned int cols, unsigned int rows, unsigned char * map, unsigned int* remap,  unsigned char * indexed_data, int quantization_method);
+/* Floyd-Steinberg dithering, rgba_data is not modified.
+   quantization_method: 1 scans every row left to right, 2 alternates direction (serpentine).
+   Returns 0 if the error rows can't be allocated, in which case indexed_data is not written. */
+int remap_floyd(network_data * networkdata, const unsigned char * rgba_data, unsigned int cols, unsigned int rows, const unsigned char * map, const unsigned int* remap,  unsigned char * indexed_data, int quantization_method);
 
-void remap_simple(network_data * networkdata, unsigned char * rgba_data, unsigned int cols, unsigned int rows, unsigned int* remap, unsigned char * indexed_data);
+/* Rows are split into bands remapped by up to threads threads. */
+void remap_simple(network_data * networkdata, unsigned char * rgba_data, unsigned int cols, unsigned int rows, unsigned int* remap, unsigned char * indexed_data, unsigned int threads);